@@ -0,0 +1,109 @@
+#ifndef __BoardConfig_h__
+#define __BoardConfig_h__
+
+#if ARDUINO >= 100
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
+
+struct ButtonDef {
+    uint8_t pin;
+    uint8_t pixel;  // position on the NeoPixel strip
+};
+
+/*
+ * Compile-time description of the hardware.
+ *
+ * A board is a struct of constexpr members, builds for other hardware add
+ * their own and select it with -DBOARD=MyBoard. Buttons are listed in
+ * button order, which is also the order of the keys and of the host
+ * commands. The combos hold one button and release another, their
+ * buttons are indexes into that list.
+ *
+ * The pin change interrupts expect the buttons on port D (pins 0-7) and
+ * both rotary pins on port B (pins 8-13).
+ */
+struct ShortyBoard {
+    static constexpr uint8_t pin_neopixels = 9;
+    static constexpr uint8_t pin_rotary_clk = 11;
+    static constexpr uint8_t pin_rotary_dt = 10;
+
+    static constexpr uint8_t button_count = 6;
+    static constexpr ButtonDef buttons[button_count] = {
+        { 4, 0 }, { 3, 1 }, { 2, 2 },
+        { 7, 5 }, { 6, 4 }, { 5, 3 }
+    };
+
+    static constexpr uint8_t combo_hold = 3;
+    static constexpr uint8_t combo_backlight = 0;       // toggle the backlight
+    static constexpr uint8_t combo_effect_next = 5;     // start or switch the effect
+    static constexpr uint8_t combo_effect_off = 4;
+    static constexpr uint8_t combo_color = 2;           // next effect or backlight color
+    static constexpr uint8_t combo_speed = 1;           // next effect speed
+};
+constexpr ButtonDef ShortyBoard::buttons[];
+
+#ifndef BOARD
+#define BOARD ShortyBoard
+#endif
+
+template <uint8_t... I> struct BoardIndices {};
+template <uint8_t N, uint8_t... I> struct MakeBoardIndices : MakeBoardIndices<N - 1, N - 1, I...> {};
+template <uint8_t... I> struct MakeBoardIndices<0, I...> {
+    typedef BoardIndices<I...> type;
+};
+
+/* Per-button tables of a board, generated at compile time into flash. */
+template <typename Board, typename Indices = typename MakeBoardIndices<Board::button_count>::type>
+struct BoardTables;
+
+template <typename Board, uint8_t... I>
+struct BoardTables<Board, BoardIndices<I...> > {
+    static const uint8_t pins[Board::button_count];
+    static const uint8_t pixels[Board::button_count];
+};
+
+template <typename Board, uint8_t... I>
+const uint8_t BoardTables<Board, BoardIndices<I...> >::pins[Board::button_count] PROGMEM = {
+    Board::buttons[I].pin...
+};
+
+template <typename Board, uint8_t... I>
+const uint8_t BoardTables<Board, BoardIndices<I...> >::pixels[Board::button_count] PROGMEM = {
+    Board::buttons[I].pixel...
+};
+
+constexpr uint8_t BUTTON_COUNT = BOARD::button_count;
+constexpr uint8_t PIN_NEOPIXELS = BOARD::pin_neopixels;
+constexpr uint8_t PIN_ROTARY_CLK = BOARD::pin_rotary_clk;
+constexpr uint8_t PIN_ROTARY_DT = BOARD::pin_rotary_dt;
+
+constexpr uint8_t COMBO_HOLD = BOARD::combo_hold;
+constexpr uint8_t COMBO_BACKLIGHT = BOARD::combo_backlight;
+constexpr uint8_t COMBO_EFFECT_NEXT = BOARD::combo_effect_next;
+constexpr uint8_t COMBO_EFFECT_OFF = BOARD::combo_effect_off;
+constexpr uint8_t COMBO_COLOR = BOARD::combo_color;
+constexpr uint8_t COMBO_SPEED = BOARD::combo_speed;
+
+/* Port of an ATmega328P Arduino pin, as the PCINT vectors split them. */
+constexpr char pinPort(uint8_t pin) {
+    return pin < 8 ? 'D' : pin < 14 ? 'B' : 'C';
+}
+
+template <typename Board>
+constexpr bool buttonsOnPort(char port, uint8_t i = 0) {
+    return i >= Board::button_count
+        || (pinPort(Board::buttons[i].pin) == port && buttonsOnPort<Board>(port, i + 1));
+}
+
+/** Button pins in flash, as ButtonEvents::begin() takes them. */
+static inline const uint8_t *buttonPins() {
+    return BoardTables<BOARD>::pins;
+}
+
+static inline uint8_t buttonPixel(uint8_t button) {
+    return pgm_read_byte(&BoardTables<BOARD>::pixels[button]);
+}
+
+#endif // __BoardConfig_h__
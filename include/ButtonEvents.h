@@ -0,0 +1,185 @@
+#ifndef __ButtonEvents_h__
+#define __ButtonEvents_h__
+
+#if ARDUINO >= 100
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
+
+#include <util/atomic.h>
+
+/** Number of buffered edge events, must be a power of two. */
+#ifndef BUTTON_EVENT_QUEUE_SIZE
+#define BUTTON_EVENT_QUEUE_SIZE 16
+#endif
+
+#ifndef BUTTON_DEBOUNCE_US
+#define BUTTON_DEBOUNCE_US 25000UL
+#endif
+
+#define BUTTON_EVENTS_MAX 8
+
+/*
+ * Debounced button state fed from timestamped edges instead of polling.
+ * Offers the subset of the JC_Button interface the firmware uses.
+ */
+class EdgeButton {
+    private:
+        bool state = false;     // debounced, true = pressed
+        bool raw = false;       // last level seen by the ISR
+        bool pressed = false;
+        bool released = false;
+        uint32_t last_change = 0;
+        uint32_t raw_change = 0;
+        uint32_t hold_time = 0;
+
+        void accept(bool level, uint32_t time) {
+            if (!level) hold_time = time - last_change;
+            state = level;
+            last_change = time;
+            if (level) pressed = true;
+            else released = true;
+        }
+
+    public:
+        void clearEdges() {
+            pressed = false;
+            released = false;
+        }
+
+        void edge(bool level, uint32_t time) {
+            raw = level;
+            raw_change = time;
+            if (level != state && time - last_change >= BUTTON_DEBOUNCE_US) {
+                accept(level, time);
+            }
+        }
+
+        // picks up level changes that happened during the debounce lockout
+        void settle(uint32_t now) {
+            if (raw != state && now - last_change >= BUTTON_DEBOUNCE_US) {
+                accept(raw, raw_change);
+            }
+        }
+
+        bool isPressed() { return state; }
+        bool isReleased() { return !state; }
+        bool wasPressed() { return pressed; }
+        bool wasReleased() { return released; }
+
+        bool pressedFor(uint32_t ms) {
+            return state && micros() - last_change >= ms * 1000UL;
+        }
+
+        /** Duration of the last completed press in µs. */
+        uint32_t heldFor() { return hold_time; }
+};
+
+/*
+ * Captures button edges with pin change interrupts.
+ *
+ * The ISR snapshots all button pins and queues the snapshot together with
+ * a micros() timestamp whenever it differs from the previous one. read()
+ * replays the queue into the EdgeButtons, so no edge is lost while the main
+ * loop is busy. The sketch has to route the PCINT vector(s) of the used
+ * ports to capture().
+ */
+class ButtonEvents {
+    private:
+        struct Event {
+            uint8_t state;
+            uint32_t time;
+        };
+
+        Event queue[BUTTON_EVENT_QUEUE_SIZE];
+        volatile uint8_t head = 0;
+        volatile uint8_t tail = 0;
+        volatile uint8_t last_state = 0;
+        uint8_t replayed = 0;   // last snapshot handed to the buttons
+
+        EdgeButton *buttons = NULL;
+        volatile uint8_t *ports[BUTTON_EVENTS_MAX];
+        uint8_t masks[BUTTON_EVENTS_MAX];
+        uint8_t count = 0;
+
+        uint8_t sample() {
+            uint8_t state = 0;
+            for (uint8_t i = 0; i < count; i++) {
+                if (!(*ports[i] & masks[i])) state |= 1 << i; // active low
+            }
+            return state;
+        }
+
+        void apply(uint8_t changed, uint8_t state, uint32_t time) {
+            for (uint8_t i = 0; i < count; i++) {
+                if (changed & (1 << i)) buttons[i].edge(state & (1 << i), time);
+            }
+        }
+
+    public:
+        volatile uint8_t overflows = 0;
+
+        /** pins is a table in flash, see BoardConfig.h. */
+        void begin(const uint8_t *pins, EdgeButton *buttons, uint8_t count) {
+            this->buttons = buttons;
+            this->count = count < BUTTON_EVENTS_MAX ? count : BUTTON_EVENTS_MAX;
+
+            for (uint8_t i = 0; i < this->count; i++) {
+                uint8_t pin = pgm_read_byte(&pins[i]);
+                pinMode(pin, INPUT_PULLUP);
+                ports[i] = portInputRegister(digitalPinToPort(pin));
+                masks[i] = digitalPinToBitMask(pin);
+            }
+
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                last_state = sample();
+                for (uint8_t i = 0; i < this->count; i++) {
+                    uint8_t pin = pgm_read_byte(&pins[i]);
+                    *digitalPinToPCMSK(pin) |= bit(digitalPinToPCMSKbit(pin));
+                    *digitalPinToPCICR(pin) |= bit(digitalPinToPCICRbit(pin));
+                }
+            }
+            replayed = last_state;
+            apply(replayed, replayed, micros());
+        }
+
+        /** To be called from the pin change ISR. */
+        void capture() {
+            uint8_t state = sample();
+            if (state == last_state) return;
+
+            uint8_t next = (head + 1) & (BUTTON_EVENT_QUEUE_SIZE - 1);
+            if (next == tail) {
+                overflows++; // retried on the next edge since last_state is kept
+                return;
+            }
+            queue[head].state = state;
+            queue[head].time = micros();
+            head = next;
+            last_state = state;
+        }
+
+        /** Replays all queued edges, to be called once per input pass. */
+        void read() {
+            for (uint8_t i = 0; i < count; i++) {
+                buttons[i].clearEdges();
+            }
+
+            while (tail != head) {
+                Event &event = queue[tail];
+                apply(event.state ^ replayed, event.state, event.time);
+                replayed = event.state;
+                tail = (tail + 1) & (BUTTON_EVENT_QUEUE_SIZE - 1);
+            }
+
+            uint32_t now = micros();
+            for (uint8_t i = 0; i < count; i++) {
+                buttons[i].settle(now);
+            }
+        }
+};
+
+ButtonEvents ButtonInput;
+
+#endif // __ButtonEvents_h__
@@ -0,0 +1,144 @@
+#ifndef __Compositor_h__
+#define __Compositor_h__
+
+#if ARDUINO >= 100
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
+
+#include <FrameBuffer.h>
+#include <PixelAnimations.h>
+
+#ifndef COMPOSITOR_LAYERS
+#define COMPOSITOR_LAYERS 5
+#endif
+
+#ifndef COMPOSITOR_PIXELS
+#define COMPOSITOR_PIXELS 8
+#endif
+
+enum BlendMode : uint8_t {
+    BLEND_NORMAL = 0,   // color over the layers below, by alpha
+    BLEND_ADD           // alpha * color added to the layers below, saturating
+};
+
+/*
+ * Stacks layers of pixel colors and hands the result to a FrameBuffer.
+ *
+ * Layers are drawn from 0 upwards. A layer only covers the pixels in its
+ * mask: set() adds a pixel, clear() takes it out again, uncovered pixels
+ * show what is below. Each layer has an alpha and a blend mode.
+ *
+ * Changes only mark the pixels they touch, and a set() to the color a pixel
+ * already has marks nothing. compose() blends just the marked pixels, so an
+ * idle frame costs one test of the dirty mask.
+ *
+ * The topmost visible layer of a pixel is passed on as its brightness
+ * layer, so layer indexes double as PixelOutput layers.
+ */
+class Compositor {
+    private:
+        struct Layer {
+            uint32_t colors[COMPOSITOR_PIXELS];
+            uint8_t mask;       // bit per pixel
+            uint8_t alpha;
+            BlendMode mode;
+        };
+
+        FrameBuffer &frame;
+        Layer layers[COMPOSITOR_LAYERS];
+        uint8_t count;
+        uint8_t dirty = 0;  // bit per pixel
+
+        static uint32_t add(uint32_t a, uint32_t b) {
+            uint32_t result = 0;
+            for (uint8_t shift = 0; shift < 24; shift += 8) {
+                uint16_t sum = ((a >> shift) & 0xFF) + ((b >> shift) & 0xFF);
+                result |= (uint32_t)(sum > 0xFF ? 0xFF : sum) << shift;
+            }
+            return result;
+        }
+
+        uint32_t blendPixel(uint8_t index, uint8_t below, uint8_t *top) {
+            uint32_t color = 0;
+            for (uint8_t i = 0; i < below; i++) {
+                Layer &layer = layers[i];
+                if (!(layer.mask & (1 << index)) || layer.alpha == 0) continue;
+
+                uint32_t over = layer.colors[index];
+                if (layer.mode == BLEND_ADD) {
+                    color = add(color, layer.alpha == 255 ? over : PixelAnimations::blend(0, over, layer.alpha));
+                } else {
+                    color = layer.alpha == 255 ? over : PixelAnimations::blend(color, over, layer.alpha);
+                }
+                if (top) *top = i;
+            }
+            return color;
+        }
+
+    public:
+        Compositor(FrameBuffer &frame, uint8_t count) : frame(frame) {
+            this->count = count < COMPOSITOR_PIXELS ? count : COMPOSITOR_PIXELS;
+            for (uint8_t i = 0; i < COMPOSITOR_LAYERS; i++) {
+                layers[i].mask = 0;
+                layers[i].alpha = 255;
+                layers[i].mode = BLEND_NORMAL;
+            }
+        }
+
+        void setBlend(uint8_t layer, uint8_t alpha, BlendMode mode = BLEND_NORMAL) {
+            if (layer >= COMPOSITOR_LAYERS) return;
+            if (layers[layer].alpha == alpha && layers[layer].mode == mode) return;
+            layers[layer].alpha = alpha;
+            layers[layer].mode = mode;
+            dirty |= layers[layer].mask;
+        }
+
+        void set(uint8_t layer, uint8_t index, uint32_t color) {
+            if (layer >= COMPOSITOR_LAYERS || index >= count) return;
+            Layer &l = layers[layer];
+            if ((l.mask & (1 << index)) && l.colors[index] == color) return;
+            l.colors[index] = color;
+            l.mask |= 1 << index;
+            dirty |= 1 << index;
+        }
+
+        void clear(uint8_t layer, uint8_t index) {
+            if (layer >= COMPOSITOR_LAYERS || index >= count) return;
+            if (!(layers[layer].mask & (1 << index))) return;
+            layers[layer].mask &= ~(1 << index);
+            dirty |= 1 << index;
+        }
+
+        void clearLayer(uint8_t layer) {
+            if (layer >= COMPOSITOR_LAYERS) return;
+            dirty |= layers[layer].mask;
+            layers[layer].mask = 0;
+        }
+
+        bool covers(uint8_t layer, uint8_t index) {
+            return layer < COMPOSITOR_LAYERS && (layers[layer].mask & (1 << index));
+        }
+
+        /** Blend of the layers below `below`, e.g. as base for an overlay. */
+        uint32_t composite(uint8_t index, uint8_t below = COMPOSITOR_LAYERS) {
+            if (index >= count) return 0;
+            return blendPixel(index, below < COMPOSITOR_LAYERS ? below : COMPOSITOR_LAYERS, NULL);
+        }
+
+        /** Blends the pixels that changed into the frame. */
+        void compose() {
+            if (!dirty) return;
+
+            for (uint8_t i = 0; i < count; i++) {
+                if (!(dirty & (1 << i))) continue;
+                uint8_t top = 0;
+                uint32_t color = blendPixel(i, COMPOSITOR_LAYERS, &top);
+                frame.set(i, color, top);
+            }
+            dirty = 0;
+        }
+};
+
+#endif // __Compositor_h__
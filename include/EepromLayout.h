@@ -0,0 +1,22 @@
+#ifndef __EepromLayout_h__
+#define __EepromLayout_h__
+
+/*
+ * EEPROM map of the ATmega328P (1024 bytes).
+ *
+ *   0 - 191    device state, ring of wear-levelled records
+ * 192 - 255    keymap, 2 records
+ * 256 - 1023   macros, 12 slots of 64 bytes
+ */
+
+#define EEPROM_STATE_START      0
+#define EEPROM_STATE_SIZE       192
+
+#define EEPROM_KEYMAP_START     192
+#define EEPROM_KEYMAP_SIZE      64
+
+#define EEPROM_MACRO_START      256
+#define EEPROM_MACRO_SLOT_SIZE  64
+#define EEPROM_MACRO_SLOTS      12
+
+#endif // __EepromLayout_h__
@@ -0,0 +1,278 @@
+#ifndef __EffectEngine_h__
+#define __EffectEngine_h__
+
+#if ARDUINO >= 100
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
+
+#include <Adafruit_NeoPixel.h>
+
+#ifndef EFFECT_FPS
+#define EFFECT_FPS 50
+#endif
+
+#ifndef EFFECT_BENCHMARK_FRAMES
+#define EFFECT_BENCHMARK_FRAMES 64
+#endif
+
+#define BLACK   (uint32_t)0x000000
+#define WHITE   (uint32_t)0xFFFFFF
+#define RED     (uint32_t)0xFF0000
+#define GREEN   (uint32_t)0x00FF00
+#define BLUE    (uint32_t)0x0000FF
+#define YELLOW  (uint32_t)0xFFFF00
+#define CYAN    (uint32_t)0x00FFFF
+#define MAGENTA (uint32_t)0xFF00FF
+#define PURPLE  (uint32_t)0x400080
+#define ORANGE  (uint32_t)0xFF3000
+
+enum EffectMode : uint8_t {
+    FX_MODE_BREATH = 0,
+    FX_MODE_RAINBOW,
+    FX_MODE_FIRE_FLICKER,
+    FX_MODE_FADE,
+    FX_MODE_SCAN,
+    FX_MODE_CHASE_COLOR,
+    FX_MODE_COUNT
+};
+
+typedef void (*EffectWrite)(uint8_t index, uint32_t color);
+
+/* What a plug-in gets to draw one frame. */
+struct EffectFrame {
+    EffectWrite write;
+    uint8_t first;      // first pixel of the segment
+    uint8_t count;
+    uint32_t color;
+    uint16_t phase;     // position in the current cycle, a cycle is `speed` ms
+    uint16_t cycle;     // completed cycles since start()
+
+    void set(uint8_t index, uint32_t color) {
+        write(first + index, color);
+    }
+
+    void fill(uint32_t color) {
+        for (uint8_t i = 0; i < count; i++) set(i, color);
+    }
+};
+
+typedef void (*EffectRender)(EffectFrame &frame);
+
+static uint32_t effectScale(uint32_t color, uint8_t level) {
+    uint16_t scale = level + 1;
+    return ((((color >> 16) & 0xFF) * scale >> 8) << 16)
+        | ((((color >> 8) & 0xFF) * scale >> 8) << 8)
+        | ((color & 0xFF) * scale >> 8);
+}
+
+/* Cheap 16 bit hash, stateless noise for the flicker effects. */
+static uint8_t effectNoise(uint16_t x) {
+    x *= 40503;
+    x ^= x >> 7;
+    x *= 40503;
+    return x >> 8;
+}
+
+/*
+ * The plug-ins. A frame is a pure function of phase and cycle, so a plug-in
+ * keeps no state and never catches up on missed frames. Every plug-in does
+ * a fixed amount of integer work per pixel: lookups in the sine table of
+ * Adafruit_NeoPixel, 8x8 bit multiplies, at most one HSV conversion. That
+ * bounds the cost of a frame by the segment length.
+ */
+
+// sine from dark to color and back, with a floor so it never goes fully off
+static void effectBreath(EffectFrame &frame) {
+    uint8_t level = Adafruit_NeoPixel::sine8((frame.phase >> 8) + 192);
+    frame.fill(effectScale(frame.color, 88 + ((level * 167) >> 8)));
+}
+
+// the whole segment cycles through the hues
+static void effectRainbow(EffectFrame &frame) {
+    frame.fill(Adafruit_NeoPixel::ColorHSV(frame.phase));
+}
+
+// color darkened by per-pixel noise, new noise every speed / count ms
+static void effectFireFlicker(EffectFrame &frame) {
+    uint8_t r = frame.color >> 16, g = frame.color >> 8, b = frame.color;
+    uint8_t lum = max(r, max(g, b)) / 3;
+    uint16_t step = frame.cycle * frame.count + (((uint32_t)frame.phase * frame.count) >> 16);
+
+    for (uint8_t i = 0; i < frame.count; i++) {
+        uint8_t flicker = lum > 0 ? effectNoise(step * 8 + i) % lum : 0;
+        frame.set(i, Adafruit_NeoPixel::Color(
+            r > flicker ? r - flicker : 0,
+            g > flicker ? g - flicker : 0,
+            b > flicker ? b - flicker : 0));
+    }
+}
+
+// linear ramp from off to color and back
+static void effectFade(EffectFrame &frame) {
+    uint16_t ramp = frame.phase >> 7;
+    uint8_t level = ramp < 256 ? ramp : 511 - ramp;
+    frame.fill(effectScale(frame.color, level));
+}
+
+// a single pixel running back and forth
+static void effectScan(EffectFrame &frame) {
+    uint8_t span = frame.count > 1 ? 2 * (frame.count - 1) : 1;
+    uint8_t pos = ((uint32_t)frame.phase * span) >> 16;
+    if (pos >= frame.count) pos = span - pos;
+
+    for (uint8_t i = 0; i < frame.count; i++) {
+        frame.set(i, i == pos ? frame.color : BLACK);
+    }
+}
+
+// two white pixels running on color
+static void effectChaseColor(EffectFrame &frame) {
+    uint8_t head = ((uint32_t)frame.phase * frame.count) >> 16;
+    uint8_t tail = head + 1 < frame.count ? head + 1 : 0;
+
+    for (uint8_t i = 0; i < frame.count; i++) {
+        frame.set(i, i == head || i == tail ? WHITE : frame.color);
+    }
+}
+
+struct EffectDef {
+    EffectRender render;
+    const char *name;   // flash
+};
+
+static const char effect_name_breath[] PROGMEM = "Breath";
+static const char effect_name_rainbow[] PROGMEM = "Rainbow";
+static const char effect_name_fire_flicker[] PROGMEM = "Fire Flicker";
+static const char effect_name_fade[] PROGMEM = "Fade";
+static const char effect_name_scan[] PROGMEM = "Scan";
+static const char effect_name_chase_color[] PROGMEM = "Chase Color";
+
+// indexed by EffectMode
+static const EffectDef effect_defs[FX_MODE_COUNT] PROGMEM = {
+    { effectBreath, effect_name_breath },
+    { effectRainbow, effect_name_rainbow },
+    { effectFireFlicker, effect_name_fire_flicker },
+    { effectFade, effect_name_fade },
+    { effectScan, effect_name_scan },
+    { effectChaseColor, effect_name_chase_color }
+};
+
+/*
+ * Runs one effect plug-in on a segment of pixels.
+ *
+ * service() draws a frame at most every 1000 / EFFECT_FPS ms. Pixels go out
+ * through the write callback, e.g. into a compositor layer, showing them is
+ * left to the caller.
+ */
+class EffectEngine {
+    private:
+        EffectWrite write;
+        uint8_t first;
+        uint8_t count;
+
+        uint8_t mode = FX_MODE_BREATH;
+        uint32_t color = RED;
+        uint16_t speed = 1000;  // ms per cycle
+
+        bool running = false;
+        uint32_t start_time = 0;
+        uint32_t last_frame = 0;
+
+        static EffectRender renderer(uint8_t mode) {
+            return (EffectRender)pgm_read_ptr(&effect_defs[mode].render);
+        }
+
+    public:
+        EffectEngine(EffectWrite write, uint8_t first, uint8_t count)
+            : write(write), first(first), count(count) {}
+
+        void setMode(uint8_t mode) {
+            if (mode < FX_MODE_COUNT) this->mode = mode;
+        }
+
+        uint8_t getMode() {
+            return mode;
+        }
+
+        void setColor(uint32_t color) {
+            this->color = color;
+        }
+
+        void setSpeed(uint16_t speed) {
+            this->speed = speed > 0 ? speed : 1;
+        }
+
+        void start() {
+            running = true;
+            start_time = millis();
+            last_frame = start_time - 1000 / EFFECT_FPS;
+        }
+
+        /** Stops drawing, the pixels keep the last frame. */
+        void pause() {
+            running = false;
+        }
+
+        bool isRunning() {
+            return running;
+        }
+
+        /** Draws the frame for `now`. */
+        void render(uint32_t now) {
+            uint32_t elapsed = now - start_time;
+            uint32_t cycle = elapsed / speed;
+            uint32_t in_cycle = elapsed - cycle * speed;
+
+            EffectFrame frame = { write, first, count, color,
+                (uint16_t)((in_cycle << 16) / speed), (uint16_t)cycle };
+            renderer(mode)(frame);
+        }
+
+        /** Draws a frame if one is due, returns true if it did. */
+        bool service() {
+            if (!running) return false;
+
+            uint32_t now = millis();
+            if (now - last_frame < 1000 / EFFECT_FPS) return false;
+            last_frame = now;
+
+            render(now);
+            return true;
+        }
+
+        /** Name of a mode in flash, print it with (const __FlashStringHelper *). */
+        static const char *getModeName(uint8_t mode) {
+            if (mode >= FX_MODE_COUNT) return nullptr;
+            return (const char *)pgm_read_ptr(&effect_defs[mode].name);
+        }
+
+#ifdef EFFECT_BENCHMARK
+        /**
+         * Prints the average cycles per frame of every plug-in, including the
+         * write callback. Blocks for a few ms, call it from setup().
+         */
+        void benchmark(Print &out) {
+            uint8_t saved = mode;
+
+            for (uint8_t m = 0; m < FX_MODE_COUNT; m++) {
+                mode = m;
+                uint32_t begin = micros();
+                for (uint16_t i = 0; i < EFFECT_BENCHMARK_FRAMES; i++) {
+                    render(start_time + i * 37UL);
+                }
+                uint32_t cycles = (micros() - begin) * (F_CPU / 1000000UL) / EFFECT_BENCHMARK_FRAMES;
+
+                out.print((const __FlashStringHelper *)getModeName(m));
+                out.print(": ");
+                out.print(cycles);
+                out.println(" cycles/frame");
+            }
+
+            mode = saved;
+        }
+#endif
+};
+
+#endif // __EffectEngine_h__
@@ -0,0 +1,83 @@
+#ifndef __FrameBuffer_h__
+#define __FrameBuffer_h__
+
+#if ARDUINO >= 100
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
+
+#include <PixelOutput.h>
+
+#ifndef FRAMEBUFFER_MAX
+#define FRAMEBUFFER_MAX 8
+#endif
+
+/*
+ * Keeps the wanted color and layer of every pixel and only pushes changed
+ * pixels through the output stage to the NeoPixel driver.
+ *
+ * show() is a no-op unless a pixel changed since the last frame, and frames
+ * are rate limited to max_fps. Writing the strip disables interrupts for the
+ * whole transfer, so every skipped frame keeps the encoder and button ISRs
+ * responsive.
+ */
+class FrameBuffer {
+    private:
+        PixelOutput &output;
+        uint32_t colors[FRAMEBUFFER_MAX];
+        uint8_t layers[FRAMEBUFFER_MAX];
+        uint8_t dirty = 0;  // bit per pixel
+        uint8_t count;
+        uint16_t frame_interval = 0; // ms
+        uint32_t last_show = 0;
+
+    public:
+        FrameBuffer(PixelOutput &output, uint8_t count) : output(output) {
+            this->count = count < FRAMEBUFFER_MAX ? count : FRAMEBUFFER_MAX;
+            memset(colors, 0, sizeof(colors));
+            memset(layers, 0, sizeof(layers));
+        }
+
+        void setMaxFps(uint8_t max_fps) {
+            frame_interval = max_fps > 0 ? 1000 / max_fps : 0;
+        }
+
+        void set(uint8_t index, uint32_t color, uint8_t layer = 0) {
+            if (index >= count) return;
+            if (colors[index] == color && layers[index] == layer) return;
+            colors[index] = color;
+            layers[index] = layer;
+            dirty |= 1 << index;
+        }
+
+        uint32_t get(uint8_t index) {
+            return index < count ? colors[index] : 0;
+        }
+
+        /** Forces a full push, e.g. after a brightness changed. */
+        void invalidate() {
+            dirty = (1 << count) - 1;
+        }
+
+        bool isDirty() {
+            return dirty != 0;
+        }
+
+        bool show() {
+            if (!dirty) return false;
+
+            uint32_t now = millis();
+            if (now - last_show < frame_interval) return false;
+
+            for (uint8_t i = 0; i < count; i++) {
+                if (dirty & (1 << i)) output.write(i, colors[i], layers[i]);
+            }
+            output.show();
+            dirty = 0;
+            last_show = now;
+            return true;
+        }
+};
+
+#endif // __FrameBuffer_h__
@@ -0,0 +1,153 @@
+#ifndef __KeyLayouts_h__
+#define __KeyLayouts_h__
+
+#if ARDUINO >= 100
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
+
+#include "hid_keys.h"
+
+/*
+ * Character to key tables for the keyboard layout the host is set to.
+ *
+ * Entries are mods << 8 | key, 0 if the layout can't type the character.
+ * Bit 7 of the key marks a dead key, which has to be followed by a space
+ * to produce the character itself. Printable ASCII is looked up directly,
+ * other characters go through the layout's (short) list of extras.
+ */
+#define KEYMAP_SHIFT (MOD_SHIFT_LEFT << 8)
+#define KEYMAP_ALTGR (MOD_ALT_RIGHT << 8)
+#define KEYMAP_DEAD  0x80
+#define KEYMAP_KEY   0x7F
+
+#define KEYMAP_FIRST 0x20
+#define KEYMAP_SIZE  96 // 0x20 - 0x7F
+
+struct KeyLayoutExtra {
+    uint16_t codepoint;
+    uint16_t entry;
+};
+
+struct KeyLayout {
+    const uint16_t *ascii;          // KEYMAP_SIZE entries in flash
+    const KeyLayoutExtra *extra;    // in flash
+    uint8_t extra_count;
+};
+
+/* Entry for c from the parallel lists chars/keys, fallback if c isn't listed. */
+constexpr uint16_t keymapFind(char c, const char *chars, const uint8_t *keys, uint16_t mods, uint16_t fallback, uint8_t i = 0) {
+    return chars[i] == 0 ? fallback
+        : chars[i] == c ? mods | keys[i]
+        : keymapFind(c, chars, keys, mods, fallback, i + 1);
+}
+
+constexpr uint16_t keymapDigit(char c) {
+    return c == '0' ? KEY_0 : KEY_1 + (c - '1');
+}
+
+#define KEYMAP_ROW(f, c) f(c), f(c + 1), f(c + 2), f(c + 3), f(c + 4), f(c + 5), f(c + 6), f(c + 7)
+#define KEYMAP_ASCII(f) \
+    KEYMAP_ROW(f, 0x20), KEYMAP_ROW(f, 0x28), KEYMAP_ROW(f, 0x30), KEYMAP_ROW(f, 0x38), \
+    KEYMAP_ROW(f, 0x40), KEYMAP_ROW(f, 0x48), KEYMAP_ROW(f, 0x50), KEYMAP_ROW(f, 0x58), \
+    KEYMAP_ROW(f, 0x60), KEYMAP_ROW(f, 0x68), KEYMAP_ROW(f, 0x70), KEYMAP_ROW(f, 0x78)
+
+/* US */
+
+constexpr uint8_t keymap_us_keys[] = {
+    KEY_SPACE, KEY_MINUS, KEY_EQUALS, KEY_LBRACKET, KEY_RBRACKET, KEY_BACKSLASH,
+    KEY_SEMICOLON, KEY_QUOTE, KEY_TILDE, KEY_COMMA, KEY_PERIOD, KEY_SLASH
+};
+constexpr uint8_t keymap_us_shift_keys[] = {
+    KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8, KEY_9, KEY_0,
+    KEY_MINUS, KEY_EQUALS, KEY_LBRACKET, KEY_RBRACKET, KEY_BACKSLASH,
+    KEY_SEMICOLON, KEY_QUOTE, KEY_TILDE, KEY_COMMA, KEY_PERIOD, KEY_SLASH
+};
+
+constexpr uint16_t keymapUS(char c) {
+    return c >= 'a' && c <= 'z' ? KEY_A + (c - 'a')
+        : c >= 'A' && c <= 'Z' ? KEYMAP_SHIFT | (KEY_A + (c - 'A'))
+        : c >= '0' && c <= '9' ? keymapDigit(c)
+        : keymapFind(c, " -=[]\\;'`,./", keymap_us_keys, 0,
+          keymapFind(c, "!@#$%^&*()_+{}|:\"~<>?", keymap_us_shift_keys, KEYMAP_SHIFT, 0));
+}
+
+const uint16_t keymap_us[KEYMAP_SIZE] PROGMEM = { KEYMAP_ASCII(keymapUS) };
+
+const KeyLayout LayoutUS PROGMEM = { keymap_us, NULL, 0 };
+
+/* DE (QWERTZ) */
+
+constexpr uint8_t keymap_de_keys[] = {
+    KEY_SPACE, KEY_RBRACKET, KEY_NONUS_NUMBER, KEY_COMMA, KEY_PERIOD, KEY_SLASH, KEY_NONUS_BACKSLASH
+};
+constexpr uint8_t keymap_de_shift_keys[] = {
+    KEY_1, KEY_2, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8, KEY_9, KEY_0, KEY_MINUS,
+    KEY_RBRACKET, KEY_NONUS_NUMBER, KEY_COMMA, KEY_PERIOD, KEY_SLASH, KEY_NONUS_BACKSLASH
+};
+constexpr uint8_t keymap_de_altgr_keys[] = {
+    KEY_Q, KEY_7, KEY_8, KEY_9, KEY_0, KEY_MINUS, KEY_RBRACKET, KEY_NONUS_BACKSLASH
+};
+constexpr uint8_t keymap_de_dead_keys[] = { KEY_TILDE };
+constexpr uint8_t keymap_de_shift_dead_keys[] = { KEY_EQUALS };
+
+constexpr uint16_t keymapDELetter(char c) {
+    return c == 'y' ? KEY_Z : c == 'z' ? KEY_Y : KEY_A + (c - 'a');
+}
+
+constexpr uint16_t keymapDE(char c) {
+    return c >= 'a' && c <= 'z' ? keymapDELetter(c)
+        : c >= 'A' && c <= 'Z' ? KEYMAP_SHIFT | keymapDELetter(c - 'A' + 'a')
+        : c >= '0' && c <= '9' ? keymapDigit(c)
+        : keymapFind(c, " +#,.-<", keymap_de_keys, 0,
+          keymapFind(c, "!\"$%&/()=?*';:_>", keymap_de_shift_keys, KEYMAP_SHIFT,
+          keymapFind(c, "@{[]}\\~|", keymap_de_altgr_keys, KEYMAP_ALTGR,
+          keymapFind(c, "^", keymap_de_dead_keys, KEYMAP_DEAD,
+          keymapFind(c, "`", keymap_de_shift_dead_keys, KEYMAP_SHIFT | KEYMAP_DEAD, 0)))));
+}
+
+const uint16_t keymap_de[KEYMAP_SIZE] PROGMEM = { KEYMAP_ASCII(keymapDE) };
+
+const KeyLayoutExtra keymap_de_extra[] PROGMEM = {
+    { 0x00E4, KEY_QUOTE },                      // ä
+    { 0x00C4, KEYMAP_SHIFT | KEY_QUOTE },       // Ä
+    { 0x00F6, KEY_SEMICOLON },                  // ö
+    { 0x00D6, KEYMAP_SHIFT | KEY_SEMICOLON },   // Ö
+    { 0x00FC, KEY_LBRACKET },                   // ü
+    { 0x00DC, KEYMAP_SHIFT | KEY_LBRACKET },    // Ü
+    { 0x00DF, KEY_MINUS },                      // ß
+    { 0x00A7, KEYMAP_SHIFT | KEY_3 },           // §
+    { 0x00B0, KEYMAP_SHIFT | KEY_TILDE },       // °
+    { 0x00B4, KEYMAP_DEAD | KEY_EQUALS },       // ´
+    { 0x00B2, KEYMAP_ALTGR | KEY_2 },           // ²
+    { 0x00B3, KEYMAP_ALTGR | KEY_3 },           // ³
+    { 0x00B5, KEYMAP_ALTGR | KEY_M },           // µ
+    { 0x20AC, KEYMAP_ALTGR | KEY_E },           // €
+};
+
+const KeyLayout LayoutDE PROGMEM = {
+    keymap_de, keymap_de_extra, sizeof(keymap_de_extra) / sizeof(keymap_de_extra[0])
+};
+
+/** Returns the entry for a unicode character, 0 if the layout can't type it. */
+static uint16_t keymapLookup(const KeyLayout &layout, uint16_t c) {
+    switch (c) {
+        case '\n': return KEY_ENTER;
+        case '\t': return KEY_TAB;
+        case '\b': return KEY_BACKSPACE;
+    }
+
+    if (c >= KEYMAP_FIRST && c < KEYMAP_FIRST + KEYMAP_SIZE) {
+        return pgm_read_word(layout.ascii + c - KEYMAP_FIRST);
+    }
+
+    for (uint8_t i = 0; i < layout.extra_count; i++) {
+        if (pgm_read_word(&layout.extra[i].codepoint) == c) {
+            return pgm_read_word(&layout.extra[i].entry);
+        }
+    }
+    return 0;
+}
+
+#endif // __KeyLayouts_h__
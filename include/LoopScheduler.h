@@ -0,0 +1,95 @@
+#ifndef __LoopScheduler_h__
+#define __LoopScheduler_h__
+
+#if ARDUINO >= 100
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
+
+/** Task slots, 6 bytes of RAM each. */
+#ifndef SCHEDULER_MAX_TASKS
+#define SCHEDULER_MAX_TASKS 12
+#endif
+
+typedef void (*TaskCallback)();
+
+/*
+ * Cooperative earliest-deadline-first scheduler for the main loop.
+ *
+ * Periodic tasks get a deadline one period after their last run. Each call
+ * to run() executes the most overdue task; when nothing is due, the idle
+ * tasks (period 0) are run round robin instead of sleeping.
+ */
+class LoopScheduler {
+    private:
+        struct Task {
+            TaskCallback callback;
+            uint16_t period;    // in µs, 0 = idle task
+            uint32_t due;       // micros() deadline
+        };
+
+        Task tasks[SCHEDULER_MAX_TASKS];
+        uint8_t task_count = 0;
+        uint8_t idle_next = 0;
+
+        bool runIdle() {
+            for (uint8_t n = 0; n < task_count; n++) {
+                Task &task = tasks[idle_next];
+                idle_next = (idle_next + 1) % task_count;
+                if (task.period == 0) {
+                    task.callback();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    public:
+        bool addTask(TaskCallback callback, uint16_t period_us) {
+            if (task_count >= SCHEDULER_MAX_TASKS) return false;
+            tasks[task_count].callback = callback;
+            tasks[task_count].period = period_us;
+            tasks[task_count].due = micros();
+            task_count++;
+            return true;
+        }
+
+        /** Changes the period of a task, a period of 0 turns it into an idle task. */
+        void setPeriod(TaskCallback callback, uint16_t period_us) {
+            for (uint8_t i = 0; i < task_count; i++) {
+                if (tasks[i].callback != callback) continue;
+                tasks[i].period = period_us;
+                tasks[i].due = micros() + period_us;
+            }
+        }
+
+        void run() {
+            uint32_t now = micros();
+            Task *next = NULL;
+            int32_t next_late = -1;
+
+            for (uint8_t i = 0; i < task_count; i++) {
+                if (tasks[i].period == 0) continue;
+                int32_t late = (int32_t)(now - tasks[i].due);
+                if (late > next_late) {
+                    next = &tasks[i];
+                    next_late = late;
+                }
+            }
+
+            if (next == NULL) {
+                runIdle();
+                return;
+            }
+
+            next->callback();
+            next->due += next->period;
+            if ((int32_t)(now - next->due) >= 0) {
+                // fell behind by more than a period, drop the missed runs
+                next->due = now + next->period;
+            }
+        }
+};
+
+#endif // __LoopScheduler_h__
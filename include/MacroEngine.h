@@ -0,0 +1,262 @@
+#ifndef __MacroEngine_h__
+#define __MacroEngine_h__
+
+#if ARDUINO >= 100
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
+
+#include <avr/eeprom.h>
+
+#include "EepromLayout.h"
+#include "USBKeyboard.h"
+
+/*
+ * Macro bytecode, stored in EEPROM slots as: length | code[length]
+ *
+ *   0x00                   end
+ *   0x01 mods key          tap a key (press and release)
+ *   0x02 mods key          press and hold a key
+ *   0x03                   release the keys held by the macro
+ *   0x04 ms_lo ms_hi       wait
+ *   0x05 len chars[len]    type text
+ *   0x06 count             repeat everything up to the next 0x07 count times
+ *   0x07                   end of repeat
+ */
+#define MACRO_END       0x00
+#define MACRO_TAP       0x01
+#define MACRO_PRESS     0x02
+#define MACRO_RELEASE   0x03
+#define MACRO_DELAY     0x04
+#define MACRO_TEXT      0x05
+#define MACRO_REPEAT    0x06
+#define MACRO_NEXT      0x07
+
+#define MACRO_NONE      0xFF
+#define MACRO_MAX_STEPS 16 // instructions per service() call
+
+/** Bytes written to EEPROM that can wait in RAM, 3 bytes of RAM each. */
+#ifndef MACRO_WRITE_QUEUE
+#define MACRO_WRITE_QUEUE 40
+#endif
+
+/*
+ * Plays macros from EEPROM without blocking.
+ *
+ * service() executes instructions until it has to wait, either for a delay
+ * to pass or for room in the keyboard's report queue, and continues from
+ * there on the next call. It also writes one queued byte of write() per
+ * call whenever the EEPROM is ready, so uploads never block for the ~3.3ms
+ * a byte takes.
+ */
+class MacroEngine {
+    private:
+        uint8_t slot = MACRO_NONE;
+        uint16_t pc = 0;
+        uint16_t end = 0;
+        uint16_t loop_pc = 0;
+        uint8_t loop_count = 0;
+        uint8_t text_pos = 0;
+        // keys held by 0x02, keys that were already down stay with their owner
+        uint8_t held_keys[KEYBOARD_REPORT_SIZE - 2];
+        uint8_t held_count = 0;
+        uint8_t held_mods = 0;
+        uint32_t wait_until = 0;
+
+        uint16_t write_address[MACRO_WRITE_QUEUE];
+        uint8_t write_value[MACRO_WRITE_QUEUE];
+        uint8_t write_head = 0;
+        uint8_t write_count = 0;
+
+        static uint16_t slotAddress(uint8_t slot) {
+            return EEPROM_MACRO_START + slot * EEPROM_MACRO_SLOT_SIZE;
+        }
+
+        static uint8_t read(uint16_t address) {
+            return eeprom_read_byte((const uint8_t *)address);
+        }
+
+        static uint8_t length(uint8_t slot) {
+            uint8_t length = read(slotAddress(slot));
+            return length < EEPROM_MACRO_SLOT_SIZE ? length : 0; // 0xFF = erased
+        }
+
+        /** Size of the instruction at pc, so it can be checked against end. */
+        uint16_t instructionSize() {
+            switch (read(pc)) {
+                case MACRO_TAP:
+                case MACRO_PRESS:
+                case MACRO_DELAY:
+                    return 3;
+                case MACRO_REPEAT:
+                    return 2;
+                case MACRO_TEXT:
+                    return pc + 1 < end ? 2 + read(pc + 1) : 2;
+                default:
+                    return 1;
+            }
+        }
+
+        static bool isDown(uint8_t key) {
+            const uint8_t *down = Keyboard.heldKeys();
+            for (uint8_t i = 2; i < KEYBOARD_REPORT_SIZE; i++) {
+                if (down[i] == key) return true;
+            }
+            return false;
+        }
+
+        void hold(uint8_t key, uint8_t mods) {
+            bool owned = key && !isDown(key);
+            uint8_t owned_mods = mods & ~Keyboard.heldKeys()[0];
+            if (!Keyboard.press(key, mods)) return;
+
+            held_mods |= owned_mods;
+            if (owned && held_count < sizeof(held_keys)) held_keys[held_count++] = key;
+        }
+
+        /** One report per key, the modifiers go with the first. */
+        uint8_t releaseReports() {
+            return held_count > 0 ? held_count : held_mods ? 1 : 0;
+        }
+
+        void releaseHeld() {
+            if (held_count == 0 && held_mods) Keyboard.release(0, held_mods);
+            for (uint8_t i = 0; i < held_count; i++) {
+                Keyboard.release(held_keys[i], i == 0 ? held_mods : 0);
+            }
+            held_count = 0;
+            held_mods = 0;
+        }
+
+        /** Writes the oldest queued byte, returns false if there is none. */
+        bool writeNext() {
+            if (write_count == 0) return false;
+            eeprom_update_byte((uint8_t *)write_address[write_head], write_value[write_head]);
+            write_head = (write_head + 1) % MACRO_WRITE_QUEUE;
+            write_count--;
+            return true;
+        }
+
+    public:
+        bool exists(uint8_t slot) {
+            return slot < EEPROM_MACRO_SLOTS && length(slot) > 0;
+        }
+
+        bool isRunning() {
+            return slot != MACRO_NONE;
+        }
+
+        bool isWriting() {
+            return write_count > 0;
+        }
+
+        void start(uint8_t slot) {
+            stop();
+            if (isWriting() || !exists(slot)) return; // half written
+
+            this->slot = slot;
+            pc = slotAddress(slot) + 1;
+            end = pc + length(slot);
+            loop_count = 0;
+            text_pos = 0;
+            wait_until = millis();
+        }
+
+        void stop() {
+            releaseHeld();
+            slot = MACRO_NONE;
+        }
+
+        /**
+         * Queues part of a slot for writing, offset 0 is the length byte.
+         * Only waits for the EEPROM if the host outruns it by more than the
+         * queue holds.
+         */
+        void write(uint8_t slot, uint8_t offset, const uint8_t *data, uint8_t count) {
+            if (slot >= EEPROM_MACRO_SLOTS || offset + count > EEPROM_MACRO_SLOT_SIZE) return;
+            if (this->slot == slot) stop();
+            for (uint8_t i = 0; i < count; i++) {
+                if (write_count == MACRO_WRITE_QUEUE) {
+                    eeprom_busy_wait();
+                    writeNext();
+                }
+                uint8_t tail = (write_head + write_count) % MACRO_WRITE_QUEUE;
+                write_address[tail] = slotAddress(slot) + offset + i;
+                write_value[tail] = data[i];
+                write_count++;
+            }
+        }
+
+        void service() {
+            if (eeprom_is_ready()) writeNext();
+
+            if (slot == MACRO_NONE) return;
+            if ((int32_t)(millis() - wait_until) < 0) return;
+
+            for (uint8_t steps = 0; steps < MACRO_MAX_STEPS; steps++) {
+                // a cut off instruction would read the next slot
+                if (pc >= end || pc + instructionSize() > end) {
+                    stop();
+                    return;
+                }
+
+                switch (read(pc)) {
+                    case MACRO_TAP:
+                        if (Keyboard.queueFree() < 2) return;
+                        Keyboard.sendKeyStroke(read(pc + 2), read(pc + 1));
+                        pc += 3;
+                        break;
+
+                    case MACRO_PRESS:
+                        if (Keyboard.queueFree() < 1) return;
+                        hold(read(pc + 2), read(pc + 1));
+                        pc += 3;
+                        break;
+
+                    case MACRO_RELEASE:
+                        if (Keyboard.queueFree() < releaseReports()) return;
+                        releaseHeld();
+                        pc += 1;
+                        break;
+
+                    case MACRO_DELAY:
+                        wait_until = millis() + (read(pc + 1) | ((uint16_t)read(pc + 2) << 8));
+                        pc += 3;
+                        return;
+
+                    case MACRO_TEXT:
+                        if (text_pos < read(pc + 1)) {
+                            if (!Keyboard.write(read(pc + 2 + text_pos))) return;
+                            text_pos++;
+                        } else {
+                            if (!Keyboard.endTyping()) return;
+                            pc += 2 + read(pc + 1);
+                            text_pos = 0;
+                        }
+                        break;
+
+                    case MACRO_REPEAT:
+                        loop_count = read(pc + 1);
+                        pc += 2;
+                        loop_pc = pc;
+                        break;
+
+                    case MACRO_NEXT:
+                        if (loop_count > 1) {
+                            loop_count--;
+                            pc = loop_pc;
+                        } else {
+                            pc += 1;
+                        }
+                        break;
+
+                    default:
+                        stop();
+                        return;
+                }
+            }
+        }
+};
+
+#endif // __MacroEngine_h__
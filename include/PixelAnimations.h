@@ -0,0 +1,93 @@
+#ifndef __PixelAnimations_h__
+#define __PixelAnimations_h__
+
+#if ARDUINO >= 100
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
+
+#ifndef PIXEL_ANIMATIONS_MAX
+#define PIXEL_ANIMATIONS_MAX 8
+#endif
+
+enum AnimationType : uint8_t {
+    ANIM_NONE = 0,
+    ANIM_FLASH,     // solid color for the whole duration
+    ANIM_PULSE,     // ramps from the base color to color and back
+    ANIM_FADE       // starts at color and fades to the base color
+};
+
+/*
+ * Transient per-pixel effects that are advanced by time instead of delay().
+ *
+ * An animation is started with a color and a duration and then applied on
+ * top of the pixel's regular color every time the pixel is rendered, until
+ * it has expired.
+ */
+class PixelAnimations {
+    private:
+        struct Animation {
+            AnimationType type;
+            uint32_t color;
+            uint16_t start;     // low 16 bits of millis()
+            uint16_t duration;  // ms
+        };
+
+        Animation animations[PIXEL_ANIMATIONS_MAX];
+
+    public:
+        static uint32_t blend(uint32_t from, uint32_t to, uint8_t amount) {
+            uint32_t result = 0;
+            for (uint8_t shift = 0; shift < 24; shift += 8) {
+                int16_t a = (from >> shift) & 0xFF;
+                int16_t b = (to >> shift) & 0xFF;
+                result |= (uint32_t)(uint8_t)(a + (((int32_t)(b - a) * amount) >> 8)) << shift;
+            }
+            return result;
+        }
+
+        void start(uint8_t index, AnimationType type, uint32_t color, uint16_t duration) {
+            if (index >= PIXEL_ANIMATIONS_MAX) return;
+            animations[index].type = type;
+            animations[index].color = color;
+            animations[index].start = millis();
+            animations[index].duration = duration;
+        }
+
+        void stop(uint8_t index) {
+            if (index >= PIXEL_ANIMATIONS_MAX) return;
+            animations[index].type = ANIM_NONE;
+        }
+
+        bool isActive(uint8_t index) {
+            if (index >= PIXEL_ANIMATIONS_MAX || animations[index].type == ANIM_NONE) return false;
+
+            Animation &anim = animations[index];
+            if ((uint16_t)((uint16_t)millis() - anim.start) >= anim.duration) {
+                anim.type = ANIM_NONE;
+                return false;
+            }
+            return true;
+        }
+
+        /** Returns base with the running animation of index applied. */
+        uint32_t apply(uint8_t index, uint32_t base) {
+            if (!isActive(index)) return base;
+
+            Animation &anim = animations[index];
+            uint16_t elapsed = (uint16_t)millis() - anim.start;
+            uint8_t progress = ((uint32_t)elapsed << 8) / anim.duration;
+
+            switch (anim.type) {
+                case ANIM_PULSE:
+                    return blend(base, anim.color, progress < 128 ? progress * 2 : (255 - progress) * 2);
+                case ANIM_FADE:
+                    return blend(anim.color, base, progress);
+                default:
+                    return anim.color;
+            }
+        }
+};
+
+#endif // __PixelAnimations_h__
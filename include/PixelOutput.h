@@ -0,0 +1,89 @@
+#ifndef __PixelOutput_h__
+#define __PixelOutput_h__
+
+#if ARDUINO >= 100
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
+
+#include <Adafruit_NeoPixel.h>
+
+#ifndef PIXEL_LAYERS_MAX
+#define PIXEL_LAYERS_MAX 8
+#endif
+
+/*
+ * Final stage between the stored colors and the NeoPixel driver.
+ *
+ * Colors are kept at full brightness everywhere else and only scaled here,
+ * on their way into the driver buffer: by the global brightness, by the
+ * brightness of the layer the pixel belongs to, then through the gamma
+ * table of Adafruit_NeoPixel. Levels are perceived brightness, so equal
+ * steps look equal.
+ *
+ * Changing a level only recomputes the scale of the layers, the writers
+ * push their stored colors again (FrameBuffer::invalidate()) and nothing
+ * has to be rendered anew. The driver's own setBrightness() scales its
+ * buffer in place and must not be used.
+ */
+class PixelOutput {
+    private:
+        Adafruit_NeoPixel &driver;
+        uint8_t brightness = 255;
+        uint8_t levels[PIXEL_LAYERS_MAX];
+        uint8_t scales[PIXEL_LAYERS_MAX];  // brightness * level, per layer
+
+        void updateScale(uint8_t layer) {
+            scales[layer] = ((uint16_t)brightness * (levels[layer] + 1)) >> 8;
+        }
+
+        static uint8_t correct(uint8_t value, uint16_t scale) {
+            return Adafruit_NeoPixel::gamma8((value * scale) >> 8);
+        }
+
+    public:
+        PixelOutput(Adafruit_NeoPixel &driver) : driver(driver) {
+            memset(levels, 255, sizeof(levels));
+            memset(scales, 255, sizeof(scales));
+        }
+
+        /** Returns false if the level didn't change. */
+        bool setBrightness(uint8_t level) {
+            if (brightness == level) return false;
+            brightness = level;
+            for (uint8_t i = 0; i < PIXEL_LAYERS_MAX; i++) updateScale(i);
+            return true;
+        }
+
+        uint8_t getBrightness() {
+            return brightness;
+        }
+
+        /** Returns false if the level didn't change. */
+        bool setLayerBrightness(uint8_t layer, uint8_t level) {
+            if (layer >= PIXEL_LAYERS_MAX || levels[layer] == level) return false;
+            levels[layer] = level;
+            updateScale(layer);
+            return true;
+        }
+
+        /** Color as it goes to the strip. */
+        uint32_t output(uint32_t color, uint8_t layer) {
+            uint16_t scale = scales[layer < PIXEL_LAYERS_MAX ? layer : 0] + 1;
+            return Adafruit_NeoPixel::Color(
+                correct(color >> 16, scale),
+                correct(color >> 8, scale),
+                correct(color, scale));
+        }
+
+        void write(uint8_t index, uint32_t color, uint8_t layer) {
+            driver.setPixelColor(index, output(color, layer));
+        }
+
+        void show() {
+            driver.show();
+        }
+};
+
+#endif // __PixelOutput_h__
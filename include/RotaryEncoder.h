@@ -0,0 +1,135 @@
+#ifndef __RotaryEncoder_h__
+#define __RotaryEncoder_h__
+
+#if ARDUINO >= 100
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
+
+#include <util/atomic.h>
+
+#define ROTARY_COUNTS_PER_DETENT 4
+
+#ifndef ROTARY_ACCELERATION
+#define ROTARY_ACCELERATION false
+#endif
+
+/*
+ * Quadrature decoder that counts detents inside the pin change ISR.
+ *
+ * Detents accumulate until the main loop collects them with take(), so no
+ * step is lost regardless of how often the loop gets around to it. The
+ * interval between the last two detents gives the rotation velocity, which
+ * feeds an optional acceleration curve.
+ */
+class RotaryEncoder {
+    private:
+        volatile uint8_t *port_a;
+        volatile uint8_t *port_b;
+        uint8_t mask_a;
+        uint8_t mask_b;
+
+        volatile uint8_t state = 0;
+        volatile int8_t counts = 0;  // since the last detent, so it never runs away
+        volatile int8_t pending = 0;
+        volatile uint32_t last_detent_time = 0;
+        volatile uint32_t detent_interval = 0xFFFFFFFF;
+
+        uint8_t read() {
+            uint8_t pins = 0;
+            if (*port_a & mask_a) pins |= 1;
+            if (*port_b & mask_b) pins |= 2;
+            return pins;
+        }
+
+    public:
+        bool acceleration = ROTARY_ACCELERATION;
+
+        /** Transitions that skipped a state, direction is guessed for those. */
+        volatile uint16_t lost = 0;
+        /** Detents that were merged into an already pending batch. */
+        uint16_t coalesced = 0;
+
+        void begin(uint8_t pin_a, uint8_t pin_b) {
+            pinMode(pin_a, INPUT_PULLUP);
+            pinMode(pin_b, INPUT_PULLUP);
+            port_a = portInputRegister(digitalPinToPort(pin_a));
+            port_b = portInputRegister(digitalPinToPort(pin_b));
+            mask_a = digitalPinToBitMask(pin_a);
+            mask_b = digitalPinToBitMask(pin_b);
+
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                state = read();
+                *digitalPinToPCMSK(pin_a) |= bit(digitalPinToPCMSKbit(pin_a));
+                *digitalPinToPCMSK(pin_b) |= bit(digitalPinToPCMSKbit(pin_b));
+                *digitalPinToPCICR(pin_a) |= bit(digitalPinToPCICRbit(pin_a));
+                *digitalPinToPCICR(pin_b) |= bit(digitalPinToPCICRbit(pin_b));
+            }
+        }
+
+        /** To be called from the pin change ISR of both pins. */
+        void update() {
+            // same transition table as the Encoder library, old state in bits 0-1
+            static const int8_t transitions[16] = {
+                0, 1, -1, 2, -1, 0, -2, 1, 1, -2, 0, -1, 2, -1, 1, 0
+            };
+
+            uint8_t pins = read();
+            int8_t delta = transitions[state | (pins << 2)];
+            state = pins;
+            if (delta == 0) return;
+            if (delta == 2 || delta == -2) lost++;
+
+            counts += delta;
+            if (counts > -ROTARY_COUNTS_PER_DETENT && counts < ROTARY_COUNTS_PER_DETENT) return;
+
+            int8_t step = counts > 0 ? 1 : -1;
+            counts -= step * ROTARY_COUNTS_PER_DETENT;
+            if (pending < 127 && pending > -127) pending += step;
+
+            uint32_t now = micros();
+            detent_interval = now - last_detent_time;
+            last_detent_time = now;
+        }
+
+        /** Time between the last two detents in µs. */
+        uint32_t interval() {
+            uint32_t value;
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                value = detent_interval;
+            }
+            return value;
+        }
+
+        /** Detents per second at the last step. */
+        uint16_t velocity() {
+            uint32_t value = interval();
+            return value < 1000 ? 1000 : 1000000UL / value;
+        }
+
+        /**
+         * Returns and clears the detents turned since the last call, scaled by
+         * the acceleration curve if enabled. Positive is clockwise.
+         */
+        int16_t take() {
+            int8_t steps;
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                steps = pending;
+                pending = 0;
+            }
+            if (steps == 0) return 0;
+
+            uint8_t count = steps > 0 ? steps : -steps;
+            coalesced += count - 1;
+
+            if (acceleration) {
+                uint32_t value = interval();
+                if (value < 15000) return steps * 4;
+                if (value < 30000) return steps * 2;
+            }
+            return steps;
+        }
+};
+
+#endif // __RotaryEncoder_h__
@@ -0,0 +1,179 @@
+#ifndef __SerialParser_h__
+#define __SerialParser_h__
+
+#if ARDUINO >= 100
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
+
+#define SERIAL_SYNC 0xCC
+#define SERIAL_FRAME_SIZE 7 // opcode + 6 params
+
+/*
+ * Protocol v2 frame:
+ *   0xC2 | length | seq | flags | payload[length] | crc8
+ * The CRC-8 (poly 0x07) covers length, seq, flags and payload. The payload
+ * is a list of sub-commands: opcode | count | params[count].
+ * Device replies use the same format with SERIAL_FLAG_REPLY set.
+ */
+#define SERIAL_SYNC_V2 0xC2
+#ifndef SERIAL_PAYLOAD_MAX
+#define SERIAL_PAYLOAD_MAX 40
+#endif
+
+#define SERIAL_FLAG_ACK     0x01 // host wants an ACK/NAK for this frame
+#define SERIAL_FLAG_REPORT  0x40 // device reply carrying data instead of an ACK/NAK
+#define SERIAL_FLAG_REPLY   0x80 // frame was sent by the device
+
+#define SERIAL_STATUS_OK        0x00
+#define SERIAL_STATUS_CRC       0x01
+#define SERIAL_STATUS_UNKNOWN   0x02
+#define SERIAL_STATUS_MALFORMED 0x03
+
+typedef void (*FrameHandler)(const uint8_t *frame);
+typedef bool (*OpcodeFilter)(uint8_t opcode);
+typedef void (*PacketHandler)(uint8_t seq, uint8_t flags, const uint8_t *payload, uint8_t length, uint8_t status);
+
+static inline uint8_t crc8_update(uint8_t crc, uint8_t data) {
+    crc ^= data;
+    for (uint8_t i = 0; i < 8; i++) {
+        crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+/*
+ * Incremental parser for the host commands.
+ *
+ * poll() consumes every byte that is available, so a frame is complete as
+ * soon as its last byte arrived. Complete frames are handed to the handlers
+ * straight from the parser's buffer. v1 frames (0xCC + 7 bytes) with an
+ * unknown opcode are dropped and the parser hunts for the next sync byte,
+ * starting with the rejected byte itself. v2 frames that are too long or
+ * fail the CRC are reported to the packet handler with an error status.
+ */
+class SerialParser {
+    private:
+        enum State : uint8_t {
+            WAIT_SYNC,
+            READ_FRAME,
+            READ_LENGTH,
+            READ_SEQ,
+            READ_FLAGS,
+            READ_PAYLOAD,
+            READ_CRC
+        };
+
+        State state = WAIT_SYNC;
+        uint8_t frame[SERIAL_PAYLOAD_MAX];
+        uint8_t length = 0;
+        uint8_t expected = 0;
+        uint8_t seq = 0;
+        uint8_t flags = 0;
+        uint8_t crc = 0;
+        FrameHandler handler;
+        OpcodeFilter accepts;
+        PacketHandler packet_handler;
+
+    public:
+        uint16_t frames = 0;    // dispatched frames
+        uint16_t errors = 0;    // frames dropped for an unknown opcode, length or CRC
+        uint16_t skipped = 0;   // bytes skipped while hunting for sync
+
+        SerialParser(FrameHandler handler, OpcodeFilter accepts, PacketHandler packet_handler)
+            : handler(handler), accepts(accepts), packet_handler(packet_handler) {}
+
+        void feed(uint8_t data) {
+            switch (state) {
+                case WAIT_SYNC:
+                    if (data == SERIAL_SYNC) {
+                        state = READ_FRAME;
+                        length = 0;
+                    } else if (data == SERIAL_SYNC_V2) {
+                        state = READ_LENGTH;
+                    } else {
+                        skipped++;
+                    }
+                    break;
+
+                case READ_FRAME:
+                    if (length == 0 && !accepts(data)) {
+                        errors++;
+                        state = WAIT_SYNC;
+                        feed(data);
+                        return;
+                    }
+
+                    frame[length++] = data;
+                    if (length == SERIAL_FRAME_SIZE) {
+                        state = WAIT_SYNC;
+                        frames++;
+                        handler(frame);
+                    }
+                    break;
+
+                case READ_LENGTH:
+                    if (data > SERIAL_PAYLOAD_MAX) {
+                        errors++;
+                        state = WAIT_SYNC;
+                        feed(data);
+                        return;
+                    }
+                    expected = data;
+                    length = 0;
+                    crc = crc8_update(0, data);
+                    state = READ_SEQ;
+                    break;
+
+                case READ_SEQ:
+                    seq = data;
+                    crc = crc8_update(crc, data);
+                    state = READ_FLAGS;
+                    break;
+
+                case READ_FLAGS:
+                    flags = data;
+                    crc = crc8_update(crc, data);
+                    state = expected > 0 ? READ_PAYLOAD : READ_CRC;
+                    break;
+
+                case READ_PAYLOAD:
+                    frame[length++] = data;
+                    crc = crc8_update(crc, data);
+                    if (length == expected) state = READ_CRC;
+                    break;
+
+                case READ_CRC:
+                    state = WAIT_SYNC;
+                    if (data != crc) {
+                        errors++;
+                        packet_handler(seq, flags, frame, 0, SERIAL_STATUS_CRC);
+                        return;
+                    }
+                    frames++;
+                    packet_handler(seq, flags, frame, length, SERIAL_STATUS_OK);
+                    break;
+            }
+        }
+
+        void poll() {
+            while (Serial.available() > 0) {
+                feed(Serial.read());
+            }
+        }
+
+        /** Sends a v2 frame to the host. */
+        static void send(uint8_t seq, uint8_t flags, const uint8_t *payload, uint8_t length) {
+            uint8_t header[4] = { SERIAL_SYNC_V2, length, seq, (uint8_t)(flags | SERIAL_FLAG_REPLY) };
+            uint8_t crc = 0;
+            for (uint8_t i = 1; i < 4; i++) crc = crc8_update(crc, header[i]);
+            for (uint8_t i = 0; i < length; i++) crc = crc8_update(crc, payload[i]);
+
+            Serial.write(header, 4);
+            Serial.write(payload, length);
+            Serial.write(crc);
+        }
+};
+
+#endif // __SerialParser_h__
@@ -0,0 +1,148 @@
+#ifndef __StateStore_h__
+#define __StateStore_h__
+
+#if ARDUINO >= 100
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
+
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+
+/** Largest snapshot, the keymap of an 8 button board takes 37 bytes. */
+#ifndef STATE_PAYLOAD_MAX
+#define STATE_PAYLOAD_MAX 40
+#endif
+
+/** Default time a change has to settle before it is written, in ms. */
+#ifndef STATE_WRITE_DELAY
+#define STATE_WRITE_DELAY 5000
+#endif
+
+/*
+ * Wear-levelled store for a small state snapshot in EEPROM.
+ *
+ * The region is a ring of records: seq | payload | crc8. Every write goes
+ * to the slot after the newest record, so each cell only sees one in
+ * `slots` writes. The CRC covers the sequence number, so a record that was
+ * cut short by a power loss is ignored and the previous one stays valid.
+ *
+ * update() takes the current snapshot as often as the caller likes; only
+ * a snapshot that differs from the last one and then stays unchanged for
+ * `delay` ms is written. service() writes one byte at a time
+ * whenever the EEPROM is ready, so it never blocks for the ~3.3ms a byte
+ * takes.
+ */
+class StateStore {
+    private:
+        uint16_t start;
+        uint8_t size;       // payload bytes
+        uint8_t slots;
+        uint8_t version;    // seeds the CRC, bump it when the payload layout changes
+        uint16_t delay;
+
+        uint8_t data[STATE_PAYLOAD_MAX];
+        bool valid = false; // data holds a loaded or taken snapshot
+        uint8_t seq = 0;
+        uint8_t slot = 0;   // slot of the newest record
+
+        bool dirty = false;
+        uint32_t due = 0;
+        int8_t write_pos = -1;  // next byte of the record being written, -1 when idle
+        uint8_t write_crc = 0;
+
+        uint16_t address(uint8_t slot) {
+            return start + slot * (size + 2);
+        }
+
+        static uint8_t read(uint16_t address) {
+            return eeprom_read_byte((const uint8_t *)address);
+        }
+
+    public:
+        uint16_t writes = 0;    // records written since boot
+
+        StateStore(uint16_t start, uint16_t length, uint8_t size, uint8_t version,
+                uint16_t delay = STATE_WRITE_DELAY)
+            : start(start), size(size), slots(length / (size + 2)), version(version), delay(delay) {
+            // a snapshot that doesn't fit or a region without room for a record is never stored
+            if (size > STATE_PAYLOAD_MAX) slots = 0;
+            slot = slots - 1;
+        }
+
+        /** Loads the newest valid record, returns false if there is none. */
+        bool load(void *snapshot) {
+            bool found = false;
+
+            for (uint8_t i = 0; i < slots; i++) {
+                uint16_t record = address(i);
+                if (read(record) == 0xFF) continue; // erased, never used as seq
+
+                uint8_t crc = _crc8_ccitt_update(version, read(record));
+                for (uint8_t j = 0; j < size; j++) {
+                    crc = _crc8_ccitt_update(crc, read(record + 1 + j));
+                }
+                if (crc != read(record + 1 + size)) continue;
+
+                // the live records span less than 128 sequence numbers
+                uint8_t record_seq = read(record);
+                if (!found || (int8_t)(record_seq - seq) > 0) {
+                    found = true;
+                    seq = record_seq;
+                    slot = i;
+                }
+            }
+
+            if (!found) return false;
+            eeprom_read_block(data, (const void *)(address(slot) + 1), size);
+            memcpy(snapshot, data, size);
+            valid = true;
+            return true;
+        }
+
+        /** Takes the current state, schedules a write if it changed. */
+        void update(const void *snapshot) {
+            if (slots == 0) return;
+            if (write_pos >= 0) return; // taken again once the write is done
+            if (valid && memcmp(data, snapshot, size) == 0) return;
+
+            memcpy(data, snapshot, size);
+            valid = true;
+            dirty = true;
+            due = millis() + delay;
+        }
+
+        bool isDirty() {
+            return dirty || write_pos >= 0;
+        }
+
+        void service() {
+            if (write_pos < 0) {
+                if (!dirty || (int32_t)(millis() - due) < 0) return;
+
+                dirty = false;
+                if (++seq == 0xFF) seq = 0;
+                slot = (slot + 1) % slots;
+                write_crc = _crc8_ccitt_update(version, seq);
+                for (uint8_t i = 0; i < size; i++) {
+                    write_crc = _crc8_ccitt_update(write_crc, data[i]);
+                }
+                write_pos = 0;
+            }
+
+            if (!eeprom_is_ready()) return;
+
+            uint8_t value = write_pos == 0 ? seq
+                : write_pos <= size ? data[write_pos - 1]
+                : write_crc;
+            eeprom_update_byte((uint8_t *)(address(slot) + write_pos), value);
+
+            if (++write_pos > size + 1) {
+                write_pos = -1;
+                writes++;
+            }
+        }
+};
+
+#endif // __StateStore_h__
@@ -8,20 +8,148 @@
 #endif
 
 #include "hid_keys.h"
+#include "KeyLayouts.h"
 
 #define LED_NUMLOCK    (1 << 0)
 #define LED_CAPSLOCK   (1 << 1)
 #define LED_SCROLLLOCK (1 << 2)
 #define LED_COMPOSE    (1 << 3)
 
+#define KEYBOARD_REPORT_SIZE 8
+#define KEYBOARD_ROLLOVER    6 // keys per boot report
+
+/* Key entries as used for button and rotary keys: mods << 8 | key */
+#define KEY_CHORD(mods, key) ((uint16_t)(mods) << 8 | (key))
+#define CHORD_KEY(entry)     ((uint8_t)((entry) & 0xFF))
+#define CHORD_MODS(entry)    ((uint8_t)((entry) >> 8))
+
+/*
+ * The 16U2 firmware in fw/ runs its UART at 9600 and only knows the v1
+ * handshake, any other frame it passes on to the host as a keyboard report.
+ * Define KEYBOARD_FAST_LINK only for a 16U2 firmware that also takes the v2
+ * handshake and switches to KEYBOARD_BAUD_FAST.
+ */
+#define KEYBOARD_BAUD_DEFAULT 9600
+#ifndef KEYBOARD_BAUD_FAST
+#define KEYBOARD_BAUD_FAST 115200
+#endif
+
+/** Number of reports buffered for sending, must be a power of two. */
+#ifndef KEYBOARD_QUEUE_SIZE
+#define KEYBOARD_QUEUE_SIZE 16
+#endif
+
+/** Layout the host is set to, see KeyLayouts.h. */
+#ifndef KEYBOARD_LAYOUT
+#define KEYBOARD_LAYOUT LayoutUS
+#endif
+
+struct KeyboardStats {
+    uint16_t sent;          // reports written to the serial port
+    uint16_t coalesced;     // reports merged into or dropped for a queued one
+    uint16_t overflows;     // keystrokes dropped because the queue or the report was full
+    uint16_t backpressure;  // service() calls that found the TX buffer full
+    uint8_t max_depth;      // highest queue fill level seen
+};
+
 class USBKeyboard {
     private:
         bool connected = false;
+        bool fast_link = false;
+        uint32_t baud = KEYBOARD_BAUD_DEFAULT;
 
-        void connectFirmware() {
-            connected = false;
+        uint8_t queue[KEYBOARD_QUEUE_SIZE][KEYBOARD_REPORT_SIZE];
+        uint8_t queue_head = 0;
+        uint8_t queue_count = 0;
+
+        uint8_t state[KEYBOARD_REPORT_SIZE] = { 0 };    // keys held with press()
+        uint8_t typed_key = 0;      // transient key on top of state, 0 after a release
+
+        KeyLayout layout;
+        uint16_t utf8_char = 0;
+        uint8_t utf8_pending = 0;   // continuation bytes still expected
+
+        uint8_t *queued(uint8_t age) {
+            return queue[(queue_head + KEYBOARD_QUEUE_SIZE - 1 - age) & (KEYBOARD_QUEUE_SIZE - 1)];
+        }
+
+        static bool isRelease(const uint8_t *report) {
+            for (uint8_t i = 0; i < KEYBOARD_REPORT_SIZE; i++) {
+                if (report[i]) return false;
+            }
+            return true;
+        }
+
+        static bool sharesKey(const uint8_t *a, const uint8_t *b) {
+            for (uint8_t i = 2; i < KEYBOARD_REPORT_SIZE; i++) {
+                if (!a[i]) continue;
+                for (uint8_t j = 2; j < KEYBOARD_REPORT_SIZE; j++) {
+                    if (a[i] == b[j]) return true;
+                }
+            }
+            return false;
+        }
+
+        static bool addKey(uint8_t *report, uint8_t key) {
+            for (uint8_t i = 2; i < KEYBOARD_REPORT_SIZE; i++) {
+                if (report[i] == key) return true;
+                if (report[i] == 0) {
+                    report[i] = key;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static void removeKey(uint8_t *report, uint8_t key) {
+            // keep the keys packed, some hosts stop at the first empty slot
+            uint8_t j = 2;
+            for (uint8_t i = 2; i < KEYBOARD_REPORT_SIZE; i++) {
+                if (report[i] != key) report[j++] = report[i];
+            }
+            while (j < KEYBOARD_REPORT_SIZE) report[j++] = 0;
+        }
+
+        /*
+         * Appends a report to the queue. Reports that have not been sent yet
+         * are coalesced: a repeated report is dropped, and a release between
+         * two presses without common keys is replaced by the second press,
+         * since the new report implicitly releases the old keys.
+         */
+        void queueReport(const uint8_t *report) {
+            if (queue_count > 0 && memcmp(queued(0), report, KEYBOARD_REPORT_SIZE) == 0) {
+                stats.coalesced++;
+                return;
+            }
+
+            if (queue_count > 1 && isRelease(queued(0)) && !isRelease(report)
+                    && !sharesKey(queued(1), report)) {
+                memcpy(queued(0), report, KEYBOARD_REPORT_SIZE);
+                stats.coalesced++;
+                return;
+            }
+
+            if (queue_count == KEYBOARD_QUEUE_SIZE) {
+                stats.overflows++;
+                return;
+            }
+
+            memcpy(queue[queue_head], report, KEYBOARD_REPORT_SIZE);
+            queue_head = (queue_head + 1) & (KEYBOARD_QUEUE_SIZE - 1);
+            queue_count++;
+            if (queue_count > stats.max_depth) stats.max_depth = queue_count;
+        }
 
-            uint8_t handshake[8] = { 0xE0, 1, 0xE0, 0, 0, 0, 0, 0 };
+        /*
+         * Sends a handshake frame and waits up to 500ms for the answer.
+         * Returns the version the firmware answered with, 0 if it didn't.
+         */
+        uint8_t handshake(uint8_t version, uint8_t param) {
+            while (Serial.available() > 0) {
+                Serial.read();
+            }
+
+            uint8_t handshake[8] = { 0xE0, version, 0xE0, param, 0, 0, 0, 0 };
             Serial.write(handshake, 8);
 
             int wait = 500;
@@ -29,19 +157,85 @@ class USBKeyboard {
                 delay(10);
                 wait -= 10;
             }
-            if (
-                    Serial.read() == 0xEF
-                    && Serial.read() == 0x01
-                    && Serial.read() == 0xEF
-               ) {
-               connected = true;
+            if (Serial.read() != 0xEF) return 0;
+            uint8_t answer = Serial.read();
+            if (Serial.read() != 0xEF) return 0;
+            return answer;
+        }
+
+        /*
+         * Handshake v2 carries the wanted baud rate / 2400 in its 4th byte.
+         * Firmware that supports it answers with version 2 and switches its
+         * UART right after the answer, which is then confirmed with a v1
+         * handshake at the new rate. Only built with KEYBOARD_FAST_LINK, the
+         * firmware in fw/ would type the v2 frame on the host.
+         */
+        void connectFirmware() {
+            connected = false;
+            fast_link = false;
+            baud = KEYBOARD_BAUD_DEFAULT;
+            Serial.begin(baud);
+
+#ifdef KEYBOARD_FAST_LINK
+            if (handshake(2, KEYBOARD_BAUD_FAST / 2400) == 2) {
+                Serial.flush();
+                Serial.begin(KEYBOARD_BAUD_FAST);
+                if (handshake(1, 0) == 1) {
+                    baud = KEYBOARD_BAUD_FAST;
+                    connected = true;
+                    fast_link = true;
+                    return;
+                }
+                Serial.begin(KEYBOARD_BAUD_DEFAULT);
+            }
+#endif
+
+            connected = handshake(1, 0) == 1;
+        }
+
+        /** Queues the held keys plus an optional transient key. */
+        void queueState(uint8_t mods, uint8_t key) {
+            uint8_t report[KEYBOARD_REPORT_SIZE];
+            memcpy(report, state, KEYBOARD_REPORT_SIZE);
+            report[0] |= mods;
+            if (key && !addKey(report, key)) stats.overflows++;
+            queueReport(report);
+        }
+
+        /*
+         * Queues the press of a layout entry. The previous key is only
+         * released when the same key comes again, otherwise the new report
+         * replaces it directly, so text takes one report per character
+         * instead of two.
+         */
+        void typeEntry(uint16_t entry) {
+            uint8_t key = entry & KEYMAP_KEY;
+            if (key == typed_key) _releaseKeys();
+
+            queueState(entry >> 8, key);
+            typed_key = key;
+
+            if (entry & KEYMAP_DEAD) {
+                // a dead key only produces its character when followed by a space
+                queueState(0, KEY_SPACE);
+                typed_key = KEY_SPACE;
             }
         }
 
     public:
+        KeyboardStats stats = { 0, 0, 0, 0, 0 };
+
+        USBKeyboard() {
+            setLayout(KEYBOARD_LAYOUT);
+        }
+
+        /** Selects one of the layouts from KeyLayouts.h. */
+        void setLayout(const KeyLayout &flash_layout) {
+            memcpy_P(&layout, &flash_layout, sizeof(KeyLayout));
+        }
+
         void init () {
-            // We will talk to atmega8u2 using 9600 bps
-            Serial.begin(9600);
+            // We will talk to atmega8u2 using 9600 bps, or faster if it agrees
             connectFirmware();
             _releaseKeys();
         }
@@ -50,26 +244,98 @@ class USBKeyboard {
             return connected;
         }
 
+        uint32_t getBaud() {
+            return baud;
+        }
+
+        /**
+         * True if the 16U2 firmware agreed to the fast link. Only that one
+         * tells frames for the host apart from keyboard reports.
+         */
+        bool hasFastLink() {
+            return fast_link;
+        }
+
         void sendKeyStroke(byte keyStroke) {
             sendKeyStroke(keyStroke, 0);
         }
 
+        /** Number of reports that can still be queued. */
+        uint8_t queueFree() {
+            return KEYBOARD_QUEUE_SIZE - queue_count;
+        }
+
+        bool isIdle() {
+            return queue_count == 0;
+        }
+
+        /** Writes queued reports as far as the serial TX buffer allows, never blocks. */
+        void service() {
+            while (queue_count > 0) {
+                if (Serial.availableForWrite() < KEYBOARD_REPORT_SIZE) {
+                    stats.backpressure++;
+                    return;
+                }
+                uint8_t tail = (queue_head + KEYBOARD_QUEUE_SIZE - queue_count) & (KEYBOARD_QUEUE_SIZE - 1);
+                Serial.write(queue[tail], KEYBOARD_REPORT_SIZE);
+                queue_count--;
+                stats.sent++;
+            }
+        }
+
+        /** Releases the key of the last stroke, keys held with press() stay down. */
         void _releaseKeys() {
             if (!connected) return;
-            uint8_t keyNone[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-            Serial.write(keyNone, 8);    // Release Key
+            queueState(0, 0);
+            typed_key = 0;
+        }
+
+        /**
+         * Adds a key and/or modifiers to the held set until release(), so
+         * several held keys and modifiers go out together in one report.
+         * Returns false if nothing was pressed: not connected or all 6 key
+         * slots taken.
+         */
+        bool press(uint8_t key, uint8_t mods = 0) {
+            if (!connected) return false;
+            if (key && !addKey(state, key)) {
+                stats.overflows++;
+                return false;
+            }
+            state[0] |= mods;
+            typed_key = 0;
+            queueState(0, 0);
+            return true;
+        }
+
+        void release(uint8_t key, uint8_t mods = 0) {
+            if (!connected) return;
+            if (key) removeKey(state, key);
+            state[0] &= ~mods;
+            typed_key = 0;
+            queueState(0, 0);
+        }
+
+        void releaseAll() {
+            memset(state, 0, KEYBOARD_REPORT_SIZE);
+            _releaseKeys();
+        }
+
+        /** Held keys and modifiers, in boot report layout. */
+        const uint8_t *heldKeys() {
+            return state;
         }
 
         void sendKeyStroke(byte keyStroke, byte modifiers) {
             if (!connected) return;
-            Serial.write(modifiers);  // Modifier Keys
-            Serial.write(0);          // Reserved
-            Serial.write(keyStroke);  // Keycode 1
-            Serial.write(0);          // Keycode 2
-            Serial.write(0);          // Keycode 3
-            Serial.write(0);          // Keycode 4
-            Serial.write(0);          // Keycode 5
-            Serial.write(0);          // Keycode 6
+            // press and release are queued together so a release is never dropped alone
+            if (queueFree() < 2) {
+                stats.overflows++;
+                return;
+            }
+
+            // the stroke goes on top of the held keys
+            queueState(modifiers, keyStroke);
 
             _releaseKeys();
         }
@@ -85,76 +351,61 @@ class USBKeyboard {
             return ledStatus;
         }
 
-        void print(char *chp)
+        /**
+         * Types the next byte of UTF-8 text, keeping the last key held until
+         * endTyping(). Returns false without consuming the byte if the queue
+         * is full. Characters the layout can't type are skipped.
+         */
+        bool write(uint8_t c) {
+            if (!connected) return true;
+            if (queueFree() < 4) return false;
+
+            if (c >= 0xC0) {
+                utf8_pending = c >= 0xE0 ? 2 : 1;
+                utf8_char = c & (c >= 0xE0 ? 0x0F : 0x1F);
+                return true;
+            }
+            if (c >= 0x80) {
+                if (utf8_pending == 0) return true;
+                utf8_char = (utf8_char << 6) | (c & 0x3F);
+                if (--utf8_pending > 0) return true;
+            } else {
+                utf8_pending = 0;
+                utf8_char = c;
+            }
+
+            uint16_t entry = keymapLookup(layout, utf8_char);
+            if (entry) typeEntry(entry);
+            return true;
+        }
+
+        /** Releases the key still held by write(). */
+        bool endTyping() {
+            if (typed_key == 0) return true;
+            if (queueFree() < 1) return false;
+            _releaseKeys();
+            return true;
+        }
+
+        /** Queues press and release of a single character. */
+        void typeChar(char c)
+        {
+            if (!write(c) || !endTyping()) stats.overflows++;
+        }
+
+        void print(const char *chp)
         {
             if (!connected) return;
-            uint8_t buf[8] = { 0 };	/* Keyboard report buffer */
 
             while (*chp) {
-                if ((*chp >= 'a') && (*chp <= 'z')) {
-                    buf[2] = *chp - 'a' + 4;
-                } else if ((*chp >= 'A') && (*chp <= 'Z')) {
-                    buf[0] = MOD_SHIFT_LEFT;	/* Caps */
-                    buf[2] = *chp - 'A' + 4;
-                } else if ((*chp >= '1') && (*chp <= '9')) {
-                    buf[2] = *chp - '1' + 30;
-                } else if (*chp == '0') {
-                    buf[2] = KEY_0;
+                if (write(*chp)) {
+                    chp++;
                 } else {
-                    switch (*chp) {
-                        case ' ':
-                            buf[2] = KEY_SPACE;	// Space
-                            break;
-                        case '-':
-                            buf[2] = KEY_MINUS;
-                            break;
-                        case '=':
-                            buf[2] = KEY_EQUALS;
-                            break;
-                        case '[':
-                            buf[2] = KEY_LBRACKET;
-                            break;
-                        case ']':
-                            buf[2] = KEY_RBRACKET;
-                            break;
-                        case '\\':
-                            buf[2] = KEY_BACKSLASH;
-                            break;
-                        case ';':
-                            buf[2] = KEY_SEMICOLON;
-                            break;
-                        case ':':
-                            buf[0] = MOD_SHIFT_LEFT;	/* Caps */
-                            buf[2] = KEY_SEMICOLON;
-                            break;
-                        case '"':
-                            buf[2] = KEY_QUOTE;
-                            break;
-                        case '~':
-                            buf[2] = KEY_TILDE;
-                            break;
-                        case ',':
-                            buf[2] = KEY_COMMA;
-                            break;
-                        case '/':
-                            buf[2] = KEY_SLASH;
-                            break;
-                        case '@':
-                            buf[0] = MOD_SHIFT_LEFT;	/* Caps */
-                            buf[2] = KEY_2;
-                            break;
-                        default:
-                            /* Character not handled. To do: add rest of chars from HUT1_11.pdf */
-                            buf[2] = KEY_PERIOD;// Period
-                            break;
-                    }
+                    service();
                 }
-
-                Serial.write(buf, 8);	// Send keystroke
-                buf[0] = 0;
-                buf[2] = 0;
-                Serial.write(buf, 8);	// Release key
-                chp++;
+            }
+            while (!endTyping()) {
+                service();
             }
         }
 };
@@ -112,6 +112,7 @@
 #define KEY_NUM_9       97
 #define KEY_NUM_0       98
 #define KEY_NUM_DOT     99
+#define KEY_NONUS_BACKSLASH 100
 
 #define KEY_APPLICATION 101
 #define KEY_POWER 102
@@ -1,8 +1,17 @@
+#define _DEFAULT_SOURCE // clock_gettime() and sockets with -std=c99
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <ctype.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include <libusb-1.0/libusb.h>
 
@@ -12,122 +21,1087 @@
 #define ACM_CTRL_DTR   0x01
 #define ACM_CTRL_RTS   0x02
 
-// static int ep_in_addr  = 0x83;
+/* UART rate of the 16U2 firmware in fw/. Firmware built with
+ * KEYBOARD_FAST_LINK switches to KEYBOARD_BAUD_FAST, pass that with -B.
+ */
+#ifndef SHORTY_BAUD
+#define SHORTY_BAUD    9600
+#endif
+
+/* Protocol v2 frame:
+ *   0xC2 | length | seq | flags | payload[length] | crc8
+ * payload: opcode | count | params[count] ...
+ */
+#define PROTO_SYNC_V1       0xCC
+#define PROTO_SYNC_V2       0xC2
+#define PROTO_PAYLOAD_MAX   40
+#define PROTO_FLAG_ACK      0x01
+#define PROTO_FLAG_REPORT   0x40
+#define PROTO_FLAG_REPLY    0x80
+#define PROTO_RETRIES       3
+
+/* Everything queued goes out in one bulk transfer when flushed, libusb
+ * splits it into packets of the endpoint's size.
+ */
+#define OUT_BUFFER_SIZE     4096
+#define OUT_TIMEOUT_MIN     250     // ms, plus the time the bytes take on the UART
+#define OUT_STALLS_MAX      3       // timeouts in a row without progress
+#define IN_FRAMES           8       // received frames kept until read
+#define IN_TIMEOUT          500     // ms to wait for a reply or report
+
+/* shortyd keeps the device open and takes commands over a Unix socket:
+ *   request: flags | length | payload[length], payload as in a v2 frame
+ * Requests with PROTO_FLAG_ACK or PROTO_FLAG_REPORT are answered with
+ *   length | payload, the reply (status, index) or the report of the device.
+ * Other requests get no answer, their commands are sent after
+ * SHORTYD_COALESCE_MS together with everything else that came in.
+ */
+#define SHORTYD_SOCKET      "shortyd.sock"
+#define SHORTYD_CLIENTS     16
+#define SHORTYD_PENDING_MAX 64
+#define SHORTYD_COALESCE_MS 5
+#define SHORTYD_TIMEOUT     3000    // ms a client waits for an answer
+#define SHORTYD_RETRY_MS    1000    // between attempts to open a missing device
+#define SHORTYD_HANDSHAKE_MS 5000   // for the firmware to answer after opening
+#define SHORTYD_BOOT_MS     2000    // for the bootloader to hand over, v1 has no replies to wait for
+#define SHORTYD_USB_FDS     8
+
+#define BUTTON_COUNT        6
+
+static int ep_in_addr  = 0x83;
 static int ep_out_addr = 0x04;
 
 static struct libusb_device_handle *devh = NULL;
+static unsigned int baud = SHORTY_BAUD;
+
+/* v1 is all the 16U2 firmware in fw/ forwards, v2 and anything the
+ * device sends back need a 16U2 firmware with the fast link.
+ */
+static int protocol = 1;
+static int want_ack = 0;
+static uint8_t seq = 0;
+static unsigned char batch[PROTO_PAYLOAD_MAX];
+static int batch_len = 0;
+
+static unsigned char out_buffer[OUT_BUFFER_SIZE];
+static int out_len = 0;
+static unsigned long out_transfers = 0;
+static unsigned long out_bytes = 0;
+static int out_error = 0;   // last libusb error of a write
+
+static int daemon_fd = -1;  // connection to shortyd in client mode
+
+/* Lighting state as reported by 0x51, indexes are 1-based like in the
+ * commands, a button color of 0 is the RGB color of the last frame.
+ */
+#define STATE_BACKLIGHT     0x01
+#define STATE_EFFECT        0x02
+#define STATE_STREAM        0x04
+
+struct device_state {
+    uint8_t flags;
+    uint8_t lit;            // bit per button
+    uint8_t backlight_color;
+    uint8_t effect;
+    uint8_t effect_color;
+    uint8_t effect_speed;   // s per cycle
+    uint8_t brightness;
+    uint8_t button_colors[BUTTON_COUNT];
+    uint8_t rgb[BUTTON_COUNT * 3];
+};
+
+struct in_frame {
+    uint8_t seq;
+    uint8_t flags;
+    uint8_t length;
+    unsigned char payload[PROTO_PAYLOAD_MAX];
+};
+
+static struct libusb_transfer *in_transfer = NULL;
+static int in_active = 0;
+static unsigned char in_data[64];
+static unsigned char in_partial[4 + PROTO_PAYLOAD_MAX + 1];
+static int in_partial_len = 0;
+static struct in_frame in_frames[IN_FRAMES];    // oldest first
+static int in_count = 0;
+
+/* The 16U2 only takes new bytes as fast as it can pass them on over the
+ * UART, so a transfer may take as long as its bytes need at the baud rate.
+ */
+unsigned int write_timeout(int size)
+{
+    return OUT_TIMEOUT_MIN + (unsigned int)((unsigned long long)size * 10 * 1000 / baud);
+}
+
+/* Writes all bytes, picking up after partial writes. Gives up after
+ * OUT_STALLS_MAX timeouts that didn't move a single byte. Returns the
+ * number of bytes written or a libusb error.
+ */
+int write_bytes(const unsigned char *data, int size)
+{
+    int written = 0;
+    int stalls = 0;
+
+    while (written < size) {
+        int actual_length = 0;
+        int result = libusb_bulk_transfer(devh, ep_out_addr, (unsigned char *)data + written,
+                                 size - written, &actual_length, write_timeout(size - written));
+        written += actual_length;
+        out_transfers++;
+
+        if (result == LIBUSB_ERROR_TIMEOUT && actual_length > 0) {
+            stalls = 0;
+        } else if (result == LIBUSB_ERROR_TIMEOUT && ++stalls < OUT_STALLS_MAX) {
+            continue;
+        } else if (result < 0) {
+            fprintf(stderr, "Error while sending (%i of %i bytes sent): %s\n",
+                    written, size, libusb_strerror(result));
+            out_bytes += written;
+            out_error = result;
+            return result;
+        }
+    }
+
+    out_bytes += written;
+    return written;
+}
+
+/* Sends the output buffer, returns 0 or a libusb error. */
+int flushOutput()
+{
+    if (out_len == 0)
+        return 0;
+
+    int result = write_bytes(out_buffer, out_len);
+    out_len = 0;
+    return result < 0 ? result : 0;
+}
+
+void queueBytes(const unsigned char *data, int size)
+{
+    if (out_len + size > OUT_BUFFER_SIZE)
+        flushOutput();
+    memcpy(out_buffer + out_len, data, size);
+    out_len += size;
+}
+
+void socketPath(char *path, size_t size)
+{
+    const char *env = getenv("SHORTYD_SOCKET");
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+
+    if (env && *env)
+        snprintf(path, size, "%s", env);
+    else if (runtime_dir && *runtime_dir)
+        snprintf(path, size, "%s/%s", runtime_dir, SHORTYD_SOCKET);
+    else
+        snprintf(path, size, "/tmp/shortyd-%u.sock", (unsigned int)getuid());
+}
+
+/* Connects to a running shortyd, returns 0 or -1 if there is none. */
+int connectDaemon()
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    socketPath(addr.sun_path, sizeof(addr.sun_path));
+
+    daemon_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (daemon_fd < 0)
+        return -1;
+    if (connect(daemon_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(daemon_fd);
+        daemon_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int write_socket(int fd, const unsigned char *data, int size)
+{
+    while (size > 0) {
+        ssize_t written = send(fd, data, size, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            return -1;
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+/* Reads exactly size bytes, returns 0 or -1 on error, EOF or timeout. */
+int read_socket(int fd, unsigned char *data, int size, int timeout)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    while (size > 0) {
+        if (poll(&pfd, 1, timeout) <= 0)
+            return -1;
+        ssize_t count = read(fd, data, size);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return -1;
+        data += count;
+        size -= count;
+    }
+    return 0;
+}
+
+/* Hands one frame worth of commands to shortyd. */
+int sendRequest(uint8_t flags, const unsigned char *payload, int length)
+{
+    unsigned char request[2 + PROTO_PAYLOAD_MAX];
+    request[0] = flags;
+    request[1] = length;
+    memcpy(request + 2, payload, length);
+
+    if (write_socket(daemon_fd, request, 2 + length) < 0) {
+        fprintf(stderr, "Error while sending to shortyd: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads the answer to a request, returns the payload length or -1. */
+int readResponse(unsigned char *payload, int size)
+{
+    unsigned char length;
+    unsigned char data[255];
+
+    if (read_socket(daemon_fd, &length, 1, SHORTYD_TIMEOUT) < 0
+            || read_socket(daemon_fd, data, length, SHORTYD_TIMEOUT) < 0) {
+        fprintf(stderr, "No answer from shortyd\n");
+        return -1;
+    }
+    if (length < size)
+        size = length;
+    memcpy(payload, data, size);
+    return size;
+}
+
+long now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+uint8_t crc8_update(uint8_t crc, uint8_t data)
+{
+    crc ^= data;
+    for (int i = 0; i < 8; i++) {
+        crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+/* Splits what the device sends into frames and keeps the valid ones. */
+void parseInput(const unsigned char *data, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (in_partial_len == 0 && data[i] != PROTO_SYNC_V2)
+            continue;
+        if (in_partial_len == 1 && data[i] > PROTO_PAYLOAD_MAX) {
+            in_partial_len = 0;
+            continue;
+        }
+        in_partial[in_partial_len++] = data[i];
+        if (in_partial_len < 4 || in_partial_len < 4 + in_partial[1] + 1)
+            continue;
+
+        uint8_t crc = 0;
+        for (int j = 1; j < in_partial_len - 1; j++)
+            crc = crc8_update(crc, in_partial[j]);
+
+        if (crc == in_partial[in_partial_len - 1]) {
+            if (in_count == IN_FRAMES) {
+                memmove(in_frames, in_frames + 1, sizeof(in_frames[0]) * (IN_FRAMES - 1));
+                in_count--;
+            }
+            in_frames[in_count].seq = in_partial[2];
+            in_frames[in_count].flags = in_partial[3];
+            in_frames[in_count].length = in_partial[1];
+            memcpy(in_frames[in_count].payload, in_partial + 4, in_partial[1]);
+            in_count++;
+        }
+        in_partial_len = 0;
+    }
+}
+
+void LIBUSB_CALL inputDone(struct libusb_transfer *transfer)
+{
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        parseInput(transfer->buffer, transfer->actual_length);
+        if (libusb_submit_transfer(transfer) == 0)
+            return;
+    }
+    in_active = 0;  // cancelled, gone or failed, the next read starts it again
+}
+
+/* Keeps a transfer on the IN endpoint, so whatever the device sends is
+ * read while libusb handles events: in readFrame() or in the loop of shortyd.
+ */
+int startInput()
+{
+    if (in_active)
+        return 0;
+    if (!in_transfer && !(in_transfer = libusb_alloc_transfer(0)))
+        return -1;
+
+    libusb_fill_bulk_transfer(in_transfer, devh, ep_in_addr, in_data, sizeof(in_data),
+                              inputDone, NULL, 0);
+    int rc = libusb_submit_transfer(in_transfer);
+    if (rc < 0) {
+        fprintf(stderr, "Error while starting to read: %s\n", libusb_strerror(rc));
+        return -1;
+    }
+    in_active = 1;
+    return 0;
+}
+
+void stopInput()
+{
+    if (in_active && libusb_cancel_transfer(in_transfer) == 0) {
+        while (in_active)
+            libusb_handle_events_completed(NULL, NULL);
+    }
+    in_active = 0;
+    in_count = 0;
+    in_partial_len = 0;
+}
+
+/* Waits for a device frame answering frame number expect_seq whose reply
+ * flags match flags. Copies its payload and returns the payload length,
+ * or -1 on timeout. Frames that came before it are stale and dropped.
+ */
+int readFrame(uint8_t expect_seq, uint8_t flags, unsigned char *payload, int size)
+{
+    long deadline = now_ms() + IN_TIMEOUT;
+
+    if (startInput() < 0)
+        return -1;
+
+    for (;;) {
+        while (in_count > 0) {
+            struct in_frame frame = in_frames[0];
+            memmove(in_frames, in_frames + 1, sizeof(in_frames[0]) * --in_count);
+
+            if (frame.seq == expect_seq && (frame.flags & (PROTO_FLAG_REPLY | PROTO_FLAG_REPORT)) == flags) {
+                int length = frame.length < size ? frame.length : size;
+                memcpy(payload, frame.payload, length);
+                return length;
+            }
+        }
+
+        long left = deadline - now_ms();
+        if (left <= 0 || !in_active)
+            return -1;
+        struct timeval timeout = { left / 1000, (left % 1000) * 1000 };
+        libusb_handle_events_timeout_completed(NULL, &timeout, NULL);
+    }
+}
+
+/* Returns the status of the ACK/NAK for frame expect_seq or -1 on timeout. */
+int readReply(uint8_t expect_seq)
+{
+    unsigned char payload[2];
+    if (readFrame(expect_seq, PROTO_FLAG_REPLY, payload, sizeof(payload)) < 1)
+        return -1;
+    return payload[0];
+}
+
+void queueV1Frame(uint8_t opcode, const uint8_t *params, int count)
+{
+    unsigned char frame[8] = { PROTO_SYNC_V1, opcode };
+    for (int i = 0; i < 6; i++) {
+        frame[2 + i] = i < count ? params[i] : 0x00;
+    }
+    queueBytes(frame, sizeof(frame));
+}
+
+/* v1 frames carry 6 params, RGB frames go out per button as index, R, G, B,
+ * streamed frames as number, index, R, G, B and macro writes as slot,
+ * offset, count and up to 3 bytes.
+ */
+void sendV1(uint8_t opcode, const uint8_t *params, int count)
+{
+    if (opcode == 0xC0 && count == BUTTON_COUNT * 3) {
+        for (int i = 0; i < BUTTON_COUNT; i++) {
+            uint8_t part[4] = { i + 1, params[i * 3], params[i * 3 + 1], params[i * 3 + 2] };
+            queueV1Frame(opcode, part, sizeof(part));
+        }
+    } else if (opcode == 0xA1 && count == 1 + BUTTON_COUNT * 3) {
+        for (int i = 0; i < BUTTON_COUNT; i++) {
+            const uint8_t *rgb = params + 1 + i * 3;
+            uint8_t part[5] = { params[0], i + 1, rgb[0], rgb[1], rgb[2] };
+            queueV1Frame(opcode, part, sizeof(part));
+        }
+    } else if (opcode == 0x4D && count > 2) {
+        for (int i = 2; i < count; i += 3) {
+            int chunk = count - i < 3 ? count - i : 3;
+            uint8_t part[6] = { params[0], params[1] + i - 2, chunk };
+            memcpy(part + 3, params + i, chunk);
+            queueV1Frame(opcode, part, 3 + chunk);
+        }
+    } else {
+        queueV1Frame(opcode, params, count);
+    }
+}
+
+/* Builds the v2 frame of the batched commands, returns its size. */
+int buildFrame(unsigned char *frame)
+{
+    frame[0] = PROTO_SYNC_V2;
+    frame[1] = batch_len;
+    frame[2] = seq;
+    frame[3] = want_ack ? PROTO_FLAG_ACK : 0;
+    memcpy(frame + 4, batch, batch_len);
+
+    uint8_t crc = 0;
+    for (int i = 1; i < 4 + batch_len; i++)
+        crc = crc8_update(crc, frame[i]);
+    frame[4 + batch_len] = crc;
+    return 5 + batch_len;
+}
+
+/* True if the device can answer: over v2, or through shortyd, which
+ * answers for itself when it can't.
+ */
+int hasReplies()
+{
+    return protocol == 2 || daemon_fd >= 0;
+}
+
+/* Moves the batched commands into the output buffer as one v2 frame,
+ * or hands them to shortyd in client mode.
+ */
+void closeFrame()
+{
+    if (batch_len == 0)
+        return;
+
+    if (daemon_fd >= 0) {
+        sendRequest(0, batch, batch_len);
+    } else {
+        unsigned char frame[4 + PROTO_PAYLOAD_MAX + 1];
+        queueBytes(frame, buildFrame(frame));
+    }
+    seq++;
+    batch_len = 0;
+}
+
+int flushToDaemon()
+{
+    if (batch_len == 0)
+        return 0;
+
+    int result = sendRequest(want_ack ? PROTO_FLAG_ACK : 0, batch, batch_len);
+    seq++;
+    batch_len = 0;
+    if (result < 0)
+        return -1;
+    if (!want_ack)
+        return 0;
+
+    unsigned char reply[2];
+    if (readResponse(reply, sizeof(reply)) < 1)
+        return -1;
+    return reply[0];
+}
+
+/* Sends everything queued so far in as few bulk transfers as possible.
+ * With -a every frame goes out on its own and is repeated until the
+ * device acknowledges it. Returns 0, a NAK status or -1 on USB errors.
+ */
+int flushCommands()
+{
+    if (daemon_fd >= 0)
+        return flushToDaemon();
+
+    if (!want_ack || batch_len == 0) {
+        closeFrame();
+        return flushOutput() < 0 ? -1 : 0;
+    }
+
+    if (flushOutput() < 0)
+        return -1;
+
+    unsigned char frame[4 + PROTO_PAYLOAD_MAX + 1];
+    int size = buildFrame(frame);
+
+    int status = 0;
+    for (int attempt = 0; attempt < PROTO_RETRIES; attempt++) {
+        queueBytes(frame, size);
+        if (flushOutput() < 0) {
+            status = -1;
+            break;
+        }
 
-void write_char(unsigned char c)
+        status = readReply(seq);
+        if (status == 0)
+            break;
+        fprintf(stderr, "Frame %i not acknowledged (%i)%s\n", seq, status,
+                attempt + 1 < PROTO_RETRIES ? ", retrying" : "");
+    }
+
+    seq++;
+    batch_len = 0;
+    return status;
+}
+
+/* Queues a command for the next frame. */
+void queueCommand(uint8_t opcode, const uint8_t *params, int count)
+{
+    if (protocol == 1 && daemon_fd < 0) {
+        sendV1(opcode, params, count);
+        return;
+    }
+
+    if (batch_len + 2 + count > PROTO_PAYLOAD_MAX) {
+        if (want_ack)
+            flushCommands();
+        else
+            closeFrame();
+    }
+
+    batch[batch_len++] = opcode;
+    batch[batch_len++] = count;
+    if (count > 0)
+        memcpy(batch + batch_len, params, count);
+    batch_len += count;
+}
+
+/* Sends a command that the device answers with a report and reads the
+ * report. Returns its length or -1 if none came.
+ */
+int requestReport(uint8_t opcode, const uint8_t *params, int count, unsigned char *report, int size)
 {
-    int actual_length;
-    int result = libusb_bulk_transfer(devh, ep_out_addr, &c, 1,
-                             &actual_length, 0);
-    if (result < 0) {
-        fprintf(stderr, "Error while sending char: %s\n", libusb_strerror(result));
+    if (!hasReplies())
+        return -1;
+
+    flushCommands();
+
+    /* the report comes before the ACK, so don't wait for ACKs here */
+    int ack = want_ack;
+    want_ack = 0;
+    queueCommand(opcode, params, count);
+
+    if (daemon_fd >= 0) {
+        int result = sendRequest(PROTO_FLAG_REPORT, batch, batch_len);
+        seq++;
+        batch_len = 0;
+        want_ack = ack;
+        return result < 0 ? -1 : readResponse(report, size);
     }
-    // fprintf(stderr, "Sent: %i\n", c);
+
+    flushCommands();
+    want_ack = ack;
+    return readFrame(seq - 1, PROTO_FLAG_REPLY | PROTO_FLAG_REPORT, report, size);
 }
 
-// int read_chars(unsigned char * data, int size)
-// {
-//     /* To receive characters from the device initiate a bulk_transfer to the
-//      * Endpoint with address ep_in_addr.
-//      */
-//     int actual_length;
-//     int rc = libusb_bulk_transfer(devh, ep_in_addr, data, size, &actual_length,
-//                                   1000);
-//     if (rc == LIBUSB_ERROR_TIMEOUT) {
-//         printf("timeout (%d)\n", actual_length);
-//         return -1;
-//     } else if (rc < 0) {
-//         fprintf(stderr, "Error while waiting for char\n");
-//         return -1;
-//     }
+/* Like queueCommand(), trailing zero params are not sent. */
+void addCommand(uint8_t opcode, const uint8_t *params, int count)
+{
+    while (count > 0 && params[count - 1] == 0)
+        count--;
 
-//     return actual_length;
-// }
+    queueCommand(opcode, params, count);
+}
 
 void setButton(uint8_t index, uint8_t state, uint8_t color_index) {
-    write_char(0xCC);
-    write_char(0xBF);
-    write_char(index);
-    write_char(state);
-    write_char(color_index);
-    write_char(0x00);
-    write_char(0x00);
-    write_char(0x00);
+    uint8_t params[] = { index, state, color_index };
+    addCommand(0xBF, params, sizeof(params));
 }
 
 void setBacklight(uint8_t state, uint8_t color_index) {
-    write_char(0xCC);
-    write_char(0xB0);
-    write_char(state);
-    write_char(color_index);
-    write_char(0x00);
-    write_char(0x00);
-    write_char(0x00);
-    write_char(0x00);
+    uint8_t params[] = { state, color_index };
+    addCommand(0xB0, params, sizeof(params));
 }
 
 void setEffect(uint8_t state, uint8_t effect_index, uint8_t color_index, uint8_t speed) {
-    write_char(0xCC);
-    write_char(0xF0);
-    write_char(state);
-    write_char(effect_index);
-    write_char(color_index);
-    write_char(speed);
-    write_char(0x00);
-    write_char(0x00);
+    uint8_t params[] = { state, effect_index, color_index, speed };
+    addCommand(0xF0, params, sizeof(params));
 }
 
 void reset() {
-    write_char(0xCC);
-    write_char(0x99);
-    write_char(0x00);
-    write_char(0x00);
-    write_char(0x00);
-    write_char(0x00);
-    write_char(0x00);
-    write_char(0x00);
+    addCommand(0x99, NULL, 0);
 }
 
-char* getArg(uint8_t index, int argc, char **argv){
-    if (index >= argc)
-        return "";
+/* Sets all buttons to arbitrary colors in one command, black turns a button off. */
+void setFrame(const uint32_t *colors) {
+    uint8_t params[BUTTON_COUNT * 3];
+    for (int i = 0; i < BUTTON_COUNT; i++) {
+        params[i * 3] = colors[i] >> 16;
+        params[i * 3 + 1] = colors[i] >> 8;
+        params[i * 3 + 2] = colors[i];
+    }
+    // not trimmed, the firmware expects a color for every button
+    queueCommand(0xC0, params, sizeof(params));
+}
 
-    return argv[index];
+/* Global brightness 0-255 in perceived brightness, not saved by the
+ * firmware, so it can follow e.g. an ambient light sensor.
+ */
+void setBrightness(uint8_t level) {
+    queueCommand(0xB1, &level, 1);
 }
 
-uint8_t isNumeric(char* input) {
-    if (strcmp(input, "0") == 0)
-        return 1;
-    if (atoi(input) > 0)
-        return 1;
+/* Reads the lighting state of the device, returns 0 or -1. */
+int queryState(struct device_state *state)
+{
+    unsigned char report[1 + sizeof(*state)];
 
+    if (requestReport(0x51, NULL, 0, report, sizeof(report)) != sizeof(report)
+            || report[0] != 0x51)
+        return -1;
+    memcpy(state, report + 1, sizeof(*state));
     return 0;
 }
 
-int main(int argc, char **argv)
+void printState()
 {
-    int rc;
+    struct device_state state;
 
-    /* Initialize libusb
-     */
-    rc = libusb_init(NULL);
-    if (rc < 0) {
-        fprintf(stderr, "Error initializing libusb: %s\n", libusb_error_name(rc));
-        exit(1);
+    if (queryState(&state) < 0) {
+        fprintf(stderr, "No state from device%s\n", hasReplies() ? "" : ", it needs protocol v2");
+        return;
+    }
+
+    printf("backlight   %s, color %i\n", state.flags & STATE_BACKLIGHT ? "on" : "off", state.backlight_color);
+    printf("effect      %s, effect %i, color %i, speed %i\n", state.flags & STATE_EFFECT ? "on" : "off",
+            state.effect, state.effect_color, state.effect_speed);
+    printf("brightness  %i%s\n", state.brightness, state.flags & STATE_STREAM ? ", streaming" : "");
+    for (int i = 0; i < BUTTON_COUNT; i++) {
+        printf("button %i    %s, ", i + 1, state.lit & (1 << i) ? "on" : "off");
+        if (state.button_colors[i])
+            printf("color %i\n", state.button_colors[i]);
+        else
+            printf("#%02x%02x%02x\n", state.rgb[i * 3], state.rgb[i * 3 + 1], state.rgb[i * 3 + 2]);
+    }
+}
+
+/* Sends frames with an opcode the firmware ignores and reports how many
+ * frames per second made it over the link.
+ */
+void throughputTest(int count) {
+    unsigned char frame[8] = { 0xCC, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    struct timespec start, end;
+    int sent = 0;
+
+    if (daemon_fd >= 0) {
+        fprintf(stderr, "The link test needs the device, stop shortyd first\n");
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < count; i++) {
+        if (write_bytes(frame, sizeof(frame)) == sizeof(frame))
+            sent++;
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%i frames in %.3fs at %u baud: %.1f frames/s, %.0f bytes/s\n",
+            sent, seconds, baud, sent / seconds, sent * sizeof(frame) / seconds);
+}
+
+/* Toggles button lights count times (rounded up to an even number so every
+ * light ends as it started) the way scripts send them, and reports how
+ * many commands per second the device took. The last frame waits for an
+ * ACK, so the time includes the device working through all of them.
+ */
+void benchCommands(int count) {
+    struct timespec start, end;
+    unsigned long transfers = out_transfers;
+    unsigned long bytes = out_bytes;
+
+    count += count % 2;
+    flushCommands();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < count; i++) {
+        setButton(i / 2 % BUTTON_COUNT + 1, 2, 0);
+    }
+
+    int acked = 0;
+    if (hasReplies()) {
+        int ack = want_ack;
+        want_ack = 1;
+        queueCommand(0x00, NULL, 0);
+        acked = flushCommands() == 0;
+        want_ack = ack;
+    } else {
+        flushCommands();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%i commands in %.3fs: %.0f commands/s, %lu bytes in %lu transfers%s\n",
+            count, seconds, count / seconds, out_bytes - bytes, out_transfers - transfers,
+            hasReplies() && !acked ? ", device did not confirm" : "");
+}
+
+#define MACRO_TAP           0x01
+#define MACRO_PRESS         0x02
+#define MACRO_RELEASE       0x03
+#define MACRO_DELAY         0x04
+#define MACRO_TEXT          0x05
+#define MACRO_REPEAT        0x06
+#define MACRO_NEXT          0x07
+#define MACRO_SLOT_SIZE     64
+#define MACRO_SLOTS         (BUTTON_COUNT * 2)
+
+struct key_name {
+    const char *name;
+    uint8_t code;
+};
+
+static const struct key_name key_names[] = {
+    { "enter", 40 }, { "esc", 41 }, { "bksp", 42 }, { "tab", 43 }, { "space", 44 },
+    { "minus", 45 }, { "equals", 46 }, { "comma", 54 }, { "period", 55 }, { "slash", 56 },
+    { "caps", 57 }, { "prtsc", 70 }, { "pause", 72 }, { "ins", 73 }, { "home", 74 },
+    { "pgup", 75 }, { "del", 76 }, { "end", 77 }, { "pgdn", 78 }, { "right", 79 },
+    { "left", 80 }, { "down", 81 }, { "up", 82 }, { "menu", 118 }, { "mute", 127 },
+    { "volup", 128 }, { "voldown", 129 }, { NULL, 0 }
+};
+
+/* Returns the HID usage id of a key name or 0 if it is unknown. */
+int keyCode(const char *name, int length) {
+    if (length == 1 && name[0] >= 'a' && name[0] <= 'z')
+        return 4 + name[0] - 'a';
+    if (length == 1 && name[0] >= '1' && name[0] <= '9')
+        return 30 + name[0] - '1';
+    if (length == 1 && name[0] == '0')
+        return 39;
+    if (length >= 2 && length <= 3 && name[0] == 'f' && isdigit(name[1])) {
+        int f = atoi(name + 1);
+        if (f >= 1 && f <= 12)
+            return 58 + f - 1;
+        if (f >= 13 && f <= 24)
+            return 104 + f - 13;
+    }
+    for (int i = 0; key_names[i].name; i++) {
+        if ((int)strlen(key_names[i].name) == length && strncmp(key_names[i].name, name, length) == 0)
+            return key_names[i].code;
+    }
+    if (length > 2 && length <= 4 && strncmp(name, "0x", 2) == 0)
+        return strtol(name + 2, NULL, 16) & 0xFF;
+    return 0;
+}
+
+/* Writes the name of a key as keyCode() understands it. */
+void keyName(uint8_t key, char *name, int size) {
+    if (key >= 4 && key <= 29) {
+        snprintf(name, size, "%c", 'a' + key - 4);
+        return;
+    }
+    if (key >= 30 && key <= 39) {
+        snprintf(name, size, "%c", key == 39 ? '0' : '1' + key - 30);
+        return;
+    }
+    if (key >= 58 && key <= 69) {
+        snprintf(name, size, "f%i", key - 58 + 1);
+        return;
+    }
+    if (key >= 104 && key <= 115) {
+        snprintf(name, size, "f%i", key - 104 + 13);
+        return;
+    }
+    for (int i = 0; key_names[i].name; i++) {
+        if (key_names[i].code == key) {
+            snprintf(name, size, "%s", key_names[i].name);
+            return;
+        }
+    }
+    snprintf(name, size, "0x%02x", key);
+}
+
+/* Parses a chord like C-S-m into modifiers and key, returns 0 on error. */
+int parseChord(const char *token, int length, uint8_t *mods, uint8_t *key) {
+    *mods = 0;
+    while (length > 2) {
+        int right = token[0] == 'R';
+        const char *mod = token + right;
+        if (length - right <= 2 || mod[1] != '-')
+            break;
+        switch (mod[0]) {
+            case 'C': *mods |= 0x01 << (right * 4); break;
+            case 'S': *mods |= 0x02 << (right * 4); break;
+            case 'A': *mods |= 0x04 << (right * 4); break;
+            case 'G': *mods |= 0x08 << (right * 4); break;
+            default: return 0;
+        }
+        token += 2 + right;
+        length -= 2 + right;
+    }
+    *key = keyCode(token, length);
+    return *key != 0;
+}
+
+/* Compiles a macro script into bytecode, returns its length or -1.
+ *
+ * Script steps are separated by commas:
+ *   C-S-m    tap a key with modifiers C- S- A- G-, right hand ones are RC- RS- RA- RG-
+ *   +C-x     press and hold,  -  releases the keys the macro holds
+ *   d:200    wait 200ms
+ *   t:text   type text, escape commas as \,
+ *   [3 ]     repeat the enclosed steps 3 times
+ */
+int compileMacro(const char *script, uint8_t *code, int size) {
+    int len = 0;
+
+    while (*script) {
+        const char *token = script;
+        int token_len = 0;
+        while (token[token_len] && token[token_len] != ',') {
+            if (token[token_len] == '\\' && token[token_len + 1])
+                token_len++;
+            token_len++;
+        }
+        script = token[token_len] ? token + token_len + 1 : token + token_len;
+        if (token_len == 0)
+            continue;
+        if (len + 3 > size)
+            return -1;
+
+        if (strncmp(token, "t:", 2) == 0) {
+            int text_len_pos = len + 1;
+            code[len++] = MACRO_TEXT;
+            code[len++] = 0;
+            for (int i = 2; i < token_len; i++) {
+                if (token[i] == '\\')
+                    i++;
+                if (len >= size)
+                    return -1;
+                code[len++] = token[i];
+                code[text_len_pos]++;
+            }
+        } else if (strncmp(token, "d:", 2) == 0) {
+            int ms = atoi(token + 2);
+            code[len++] = MACRO_DELAY;
+            code[len++] = ms & 0xFF;
+            code[len++] = (ms >> 8) & 0xFF;
+        } else if (token[0] == '[') {
+            code[len++] = MACRO_REPEAT;
+            code[len++] = atoi(token + 1);
+        } else if (token_len == 1 && token[0] == ']') {
+            code[len++] = MACRO_NEXT;
+        } else if (token_len == 1 && token[0] == '-') {
+            code[len++] = MACRO_RELEASE;
+        } else {
+            int hold = token[0] == '+';
+            uint8_t mods, key;
+            if (!parseChord(token + hold, token_len - hold, &mods, &key)) {
+                fprintf(stderr, "Unknown key '%.*s'\n", token_len, token);
+                return -1;
+            }
+            code[len++] = hold ? MACRO_PRESS : MACRO_TAP;
+            code[len++] = mods;
+            code[len++] = key;
+        }
+    }
+    return len;
+}
+
+#define KEYMAP_ENTRIES      (BUTTON_COUNT * 2 + 2)
+
+/* Binds key 1-14 (short presses, long presses, rotary cw and ccw) to a chord
+ * like C-S-m, "none" unbinds it. Hold keeps a short press key down while the
+ * button is pressed.
+ */
+void setKey(uint8_t index, const char *chord, int hold)
+{
+    uint8_t params[4] = { index, 0, 0, hold };
+
+    if (index < 1 || index > KEYMAP_ENTRIES) {
+        fprintf(stderr, "Invalid key %i\n", index);
+        return;
+    }
+    if (strcmp(chord, "none") != 0 && !parseChord(chord, strlen(chord), &params[1], &params[2])) {
+        fprintf(stderr, "Unknown key '%s'\n", chord);
+        return;
+    }
+    if (hold && index > BUTTON_COUNT) {
+        fprintf(stderr, "Only short presses can hold their key\n");
+        return;
+    }
+    queueCommand(0x4B, params, sizeof(params));
+}
+
+void printKeymap()
+{
+    static const char *mod_names[] = { "C-", "S-", "A-", "G-", "RC-", "RS-", "RA-", "RG-" };
+    unsigned char report[2 + KEYMAP_ENTRIES * 2];
+
+    if (!hasReplies()) {
+        fprintf(stderr, "Keymaps need protocol v2\n");
+        return;
+    }
+
+    if (requestReport(0x4C, NULL, 0, report, sizeof(report)) != sizeof(report)) {
+        fprintf(stderr, "No keymap from device\n");
+        return;
+    }
+
+    for (int i = 0; i < KEYMAP_ENTRIES; i++) {
+        uint8_t mods = report[2 + i * 2];
+        uint8_t key = report[3 + i * 2];
+        char name[8];
+
+        if (i < BUTTON_COUNT)
+            printf("%2i button %i       ", i + 1, i + 1);
+        else if (i < BUTTON_COUNT * 2)
+            printf("%2i button %i long  ", i + 1, i + 1 - BUTTON_COUNT);
+        else
+            printf("%2i rotary %s ", i + 1, i == BUTTON_COUNT * 2 ? "cw        " : "ccw       ");
+
+        for (int m = 0; m < 8; m++) {
+            if (mods & (1 << m))
+                printf("%s", mod_names[m]);
+        }
+        keyName(key, name, sizeof(name));
+        printf("%s%s\n", key ? name : "none",
+                i < BUTTON_COUNT && (report[1] & (1 << i)) ? " (hold)" : "");
+    }
+}
+
+/* Uploads a macro for trigger 1-12 (short presses, then long presses).
+ * The length byte is cleared first and written last, so the firmware never
+ * plays a half written macro.
+ */
+void setMacro(uint8_t trigger, const char *script) {
+    uint8_t code[MACRO_SLOT_SIZE - 1];
+    uint8_t params[PROTO_PAYLOAD_MAX - 2];
+    int chunk_max = sizeof(params) - 2;
+
+    if (trigger < 1 || trigger > MACRO_SLOTS) {
+        fprintf(stderr, "Invalid macro trigger %i\n", trigger);
+        return;
+    }
+
+    int len = compileMacro(script, code, sizeof(code));
+    if (len < 0) {
+        fprintf(stderr, "Macro doesn't fit into %i bytes\n", (int)sizeof(code));
+        return;
+    }
+
+    params[0] = trigger - 1;
+    params[1] = 0;
+    params[2] = 0;
+    queueCommand(0x4D, params, 3);
+
+    for (int offset = 0; offset < len; offset += chunk_max) {
+        int chunk = len - offset < chunk_max ? len - offset : chunk_max;
+        params[1] = 1 + offset;
+        memcpy(params + 2, code + offset, chunk);
+        queueCommand(0x4D, params, 2 + chunk);
+    }
+
+    params[1] = 0;
+    params[2] = len;
+    queueCommand(0x4D, params, 3);
+}
+
+/* Streams raw frames (6 x R, G, B bytes) from stdin at fps frames per second
+ * and prints the device's frame statistics at the end.
+ */
+void streamFrames(int fps) {
+    uint8_t params[1 + BUTTON_COUNT * 3];
+    uint8_t start[] = { 1, fps };
+    struct timespec next;
+    int sent = 0;
+    int late = 0;
+
+    /* a frame is one v2 frame or a v1 frame per button, 10 bits a byte */
+    int frame_bytes = protocol == 1 ? BUTTON_COUNT * 8 : 5 + sizeof(params) + 2;
+    int max_fps = baud / 10 / frame_bytes;
+    if (fps > max_fps) {
+        fprintf(stderr, "The link carries at most %i fps at %u baud\n", max_fps, baud);
+        fps = max_fps;
+    }
+
+    flushCommands();
+    queueCommand(0xA0, start, sizeof(start));
+    flushCommands();
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    params[0] = 0;
+    while (fread(params + 1, 1, BUTTON_COUNT * 3, stdin) == BUTTON_COUNT * 3) {
+        queueCommand(0xA1, params, sizeof(params));
+        flushCommands();
+        params[0]++;
+        sent++;
+
+        next.tv_nsec += 1000000000L / fps;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0)
+            break;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec - next.tv_nsec > 1000000L))
+            late++;
+    }
+
+    unsigned char report[7];
+    if (requestReport(0xA2, NULL, 0, report, sizeof(report)) == sizeof(report)) {
+        printf("sent %i frames (%i late), device presented %i, dropped %i, late %i\n", sent, late,
+                report[1] | report[2] << 8, report[3] | report[4] << 8, report[5] | report[6] << 8);
+    } else {
+        printf("sent %i frames (%i late), no statistics from device\n", sent, late);
+    }
+
+    start[0] = 0;
+    queueCommand(0xA0, start, 1);
+    flushCommands();
+}
+
+char* getArg(uint8_t index, int argc, char **argv){
+    if (index >= argc)
+        return "";
+
+    return argv[index];
+}
+
+uint8_t isColor(char* input) {
+    char *end;
+    if (input[0] == '#')
+        input++;
+    if (strlen(input) != 6)
+        return 0;
+    strtoul(input, &end, 16);
+    return *end == '\0';
+}
+
+uint32_t parseColor(char* input) {
+    if (input[0] == '#')
+        input++;
+    return strtoul(input, NULL, 16);
+}
+
+uint8_t isNumeric(char* input) {
+    if (strcmp(input, "0") == 0)
+        return 1;
+    if (atoi(input) > 0)
+        return 1;
 
-    /* Set debugging output to max level.
-     */
-    // libusb_set_debug(NULL, 3);
+    return 0;
+}
+
+/* Opens and claims the device and sets up the serial line. Returns 0,
+ * LIBUSB_ERROR_NOT_FOUND if there is no device or -1 on errors.
+ */
+int openDevice()
+{
+    int rc;
 
     devh = libusb_open_device_with_vid_pid(NULL, VENDOR_ID, PRODUCT_ID);
-    if (!devh) {
-        fprintf(stderr, "Error finding USB device\n");
-        goto out;
-    }
+    if (!devh)
+        return LIBUSB_ERROR_NOT_FOUND;
 
     /* As we are dealing with a CDC-ACM device, it's highly probable that
      * Linux already attached the cdc-acm driver to this device.
@@ -143,7 +1117,7 @@ int main(int argc, char **argv)
         if (rc < 0) {
             fprintf(stderr, "Error claiming interface: %s\n",
                     libusb_error_name(rc));
-            goto out;
+            return -1;
         }
     }
 
@@ -155,26 +1129,683 @@ int main(int argc, char **argv)
     if (rc < 0) {
         fprintf(stderr, "Error during control transfer: %s\n",
                 libusb_error_name(rc));
-        goto out;
+        return -1;
     }
 
-    /* - set line encoding: here 9600 8N1
+    /* - set line encoding: baud 8N1, must match the rate the firmware negotiated
      * 9600 = 0x2580 ~> 0x80, 0x25 in little endian
      */
-    unsigned char encoding[] = { 0x80, 0x25, 0x00, 0x00, 0x00, 0x00, 0x08 };
+    unsigned char encoding[] = { baud & 0xFF, (baud >> 8) & 0xFF, (baud >> 16) & 0xFF,
+                                 (baud >> 24) & 0xFF, 0x00, 0x00, 0x08 };
     rc = libusb_control_transfer(devh, 0x21, 0x20, 0, 0, encoding,
                                 sizeof(encoding), 0);
     if (rc < 0) {
         fprintf(stderr, "Error during control transfer: %s\n",
                 libusb_error_name(rc));
-        goto out;
+        return -1;
+    }
+
+    return 0;
+}
+
+void closeDevice()
+{
+    if (!devh)
+        return;
+
+    stopInput();
+    libusb_release_interface(devh, 0);
+    libusb_release_interface(devh, 1);
+    libusb_close(devh);
+    devh = NULL;
+}
+
+/* shortyd */
+
+struct pending_command {
+    uint8_t opcode;
+    uint8_t count;
+    uint8_t params[PROTO_PAYLOAD_MAX - 2];
+};
+
+struct daemon_client {
+    int fd;
+    int length;
+    unsigned char buffer[2 + PROTO_PAYLOAD_MAX];
+};
+
+static struct pending_command pending[SHORTYD_PENDING_MAX];
+static int pending_count = 0;
+static long pending_since = 0;
+static volatile sig_atomic_t daemon_running = 1;
+
+/* The lighting state the clients asked for, one command per target (reset,
+ * backlight, brightness, effect, frame, each button), in the order they
+ * last changed. Replayed when the device comes back, it forgets what it
+ * didn't save yet and never saves frames and brightness.
+ */
+#define DESIRED_MAX (5 + BUTTON_COUNT)
+static struct pending_command desired[DESIRED_MAX];
+static int desired_count = 0;
+
+/* What the device shows, read once after attaching and then kept in step
+ * with what is sent. A firmware that doesn't answer isn't asked again.
+ */
+static struct device_state device_state;
+static int state_known = 0;
+static int state_queryable = 1;
+
+static int hotplug = 0;
+static long attach_at = 0;  // next attempt to open the device, -1 waits for hotplug
+static long ready_at = -1;  // v1: when the opened device has booted, -1 once it has
+
+/* True once the device is open and its firmware is up. */
+int deviceReady()
+{
+    return devh && ready_at < 0;
+}
+
+void stopDaemon(int sig)
+{
+    (void)sig;
+    daemon_running = 0;
+}
+
+int pendingParam(const struct pending_command *cmd, int i)
+{
+    return i < cmd->count ? cmd->params[i] : 0;
+}
+
+/* True if the params from `first` on leave nothing of the older command
+ * visible: the state is a plain on/off, and every value the older command
+ * sets (non-zero) is set by the newer one too.
+ */
+int coversParams(const struct pending_command *cmd, const struct pending_command *old, int first)
+{
+    if (pendingParam(cmd, first) > 1)
+        return 0;   // toggle or any other state that depends on the one before
+    for (int i = first + 1; i < PROTO_PAYLOAD_MAX - 2; i++) {
+        if (pendingParam(cmd, i) == 0 && pendingParam(old, i) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* True if sending cmd makes sending old pointless. Only the latest state
+ * counts for buttons, backlight, effect, frames and brightness; status,
+ * macros, streams and no-ops always go out.
+ */
+int supersedes(const struct pending_command *cmd, const struct pending_command *old)
+{
+    if (cmd->opcode == 0x99)
+        return old->opcode == 0x99 || old->opcode == 0xB0 || old->opcode == 0xBF
+            || old->opcode == 0xF0 || old->opcode == 0xC0;
+    if (cmd->opcode == 0xC0)
+        return old->opcode == 0xC0 || old->opcode == 0xBF;
+    if (cmd->opcode != old->opcode)
+        return 0;
+
+    switch (cmd->opcode) {
+        case 0xB1:
+            return 1;
+        case 0x4B:
+            return pendingParam(cmd, 0) == pendingParam(old, 0);
+        case 0xB0:
+        case 0xF0:
+            return coversParams(cmd, old, 0);
+        case 0xBF:
+            return pendingParam(cmd, 0) == pendingParam(old, 0) && coversParams(cmd, old, 1);
+    }
+    return 0;
+}
+
+/* Index of the param holding the on/off/toggle state, -1 for none. */
+int stateParam(uint8_t opcode)
+{
+    if (opcode == 0xB0 || opcode == 0xF0)
+        return 0;
+    if (opcode == 0xBF)
+        return 1;
+    return -1;
+}
+
+int sameTarget(const struct pending_command *cmd, const struct pending_command *old)
+{
+    return old->opcode == cmd->opcode
+        && (cmd->opcode != 0xBF || pendingParam(old, 0) == pendingParam(cmd, 0));
+}
+
+/* On/off state the desired state has for the target of cmd, -1 if unknown. */
+int desiredState(const struct pending_command *cmd)
+{
+    int index = pendingParam(cmd, 0) - 1;
+
+    for (int i = desired_count - 1; i >= 0; i--) {
+        const struct pending_command *old = &desired[i];
+        if (sameTarget(cmd, old))
+            return pendingParam(old, stateParam(old->opcode));
+        if (cmd->opcode == 0xBF && old->opcode == 0xC0 && index >= 0 && index < BUTTON_COUNT)
+            return (pendingParam(old, index * 3) | pendingParam(old, index * 3 + 1)
+                    | pendingParam(old, index * 3 + 2)) != 0;
+        if (old->opcode == 0x99)
+            return 0;
+    }
+    return -1;
+}
+
+/* Folds a command into the desired state. Params of 0 keep the value the
+ * target had, toggles flip it. A toggle of a state that isn't known drops
+ * the target, the device keeps what it has for it.
+ */
+void rememberState(const struct pending_command *cmd)
+{
+    if (cmd->opcode != 0x99 && cmd->opcode != 0xB0 && cmd->opcode != 0xB1
+            && cmd->opcode != 0xBF && cmd->opcode != 0xF0 && cmd->opcode != 0xC0)
+        return;
+    /* the device ignores these, and each would take a target of its own */
+    if (cmd->opcode == 0xBF && (pendingParam(cmd, 0) < 1 || pendingParam(cmd, 0) > BUTTON_COUNT))
+        return;
+    if (cmd->opcode == 0xC0 && cmd->count != BUTTON_COUNT * 3)
+        return;
+
+    struct pending_command merged = *cmd;
+    int state = stateParam(cmd->opcode);
+    int known = 1;
+    int kept = 0;
+
+    if (state >= 0 && pendingParam(cmd, state) > 1) {
+        int current = desiredState(cmd);
+        known = current >= 0;
+        merged.params[state] = !current;
+    }
+
+    for (int i = 0; i < desired_count; i++) {
+        struct pending_command *old = &desired[i];
+        int same = sameTarget(cmd, old);
+
+        if (same && state >= 0) {
+            for (int p = state + 1; p < old->count; p++) {
+                if (pendingParam(&merged, p) == 0)
+                    merged.params[p] = old->params[p];
+            }
+            if (merged.count < old->count)
+                merged.count = old->count;
+        }
+        if (!same && !supersedes(cmd, old))
+            desired[kept++] = *old;
+    }
+    desired_count = kept;
+
+    if (known && desired_count < DESIRED_MAX)
+        desired[desired_count++] = merged;
+}
+
+/* On/off param against the current state: a toggle becomes the state it
+ * ends in, so it is right however often it is sent.
+ */
+int resolveState(struct pending_command *cmd, int i, int current)
+{
+    int value = pendingParam(cmd, i);
+    if (value > 1) {
+        value = value == 2 ? !current : current;
+        cmd->params[i] = value;
+    }
+    return value;
+}
+
+/* Index param against the current value, 0 keeps it. */
+int updateIndex(uint8_t *current, const struct pending_command *cmd, int i)
+{
+    int value = pendingParam(cmd, i);
+    if (value == 0 || value == *current)
+        return 0;
+    *current = value;
+    return 1;
+}
+
+int updateFlag(uint8_t *flags, uint8_t flag, int on)
+{
+    int changed = !(*flags & flag) != !on;
+    *flags = on ? *flags | flag : *flags & ~flag;
+    return changed;
+}
+
+/* Checks cmd against the device state and applies it there. Returns 0 if
+ * it changes nothing and needn't be sent, -1 if the state is unknown after it.
+ */
+int deltaCommand(struct device_state *state, struct pending_command *cmd)
+{
+    int index = pendingParam(cmd, 0) - 1;
+    int changed = 0;
+
+    switch (cmd->opcode) {
+        case 0xB0:
+            changed |= updateFlag(&state->flags, STATE_BACKLIGHT,
+                                  resolveState(cmd, 0, state->flags & STATE_BACKLIGHT));
+            changed |= updateIndex(&state->backlight_color, cmd, 1);
+            return changed;
+
+        case 0xB1:
+            changed = pendingParam(cmd, 0) != state->brightness;
+            state->brightness = pendingParam(cmd, 0);
+            return changed;
+
+        case 0xBF:
+            if (index < 0 || index >= BUTTON_COUNT)
+                return 1;
+            changed |= updateFlag(&state->lit, 1 << index,
+                                  resolveState(cmd, 1, state->lit & (1 << index)));
+            changed |= updateIndex(&state->button_colors[index], cmd, 2);
+            return changed;
+
+        case 0xF0:
+            changed |= updateFlag(&state->flags, STATE_EFFECT,
+                                  resolveState(cmd, 0, state->flags & STATE_EFFECT));
+            changed |= updateIndex(&state->effect, cmd, 1);
+            changed |= updateIndex(&state->effect_color, cmd, 2);
+            changed |= updateIndex(&state->effect_speed, cmd, 3);
+            return changed;
+
+        case 0xC0:
+            if (cmd->count != BUTTON_COUNT * 3)
+                return 1;
+            for (int i = 0; i < BUTTON_COUNT; i++) {
+                const uint8_t *rgb = cmd->params + i * 3;
+                changed |= updateFlag(&state->lit, 1 << i, rgb[0] | rgb[1] | rgb[2]);
+                changed |= state->button_colors[i] != 0;
+                state->button_colors[i] = 0;
+            }
+            changed |= memcmp(state->rgb, cmd->params, sizeof(state->rgb)) != 0;
+            memcpy(state->rgb, cmd->params, sizeof(state->rgb));
+            return changed;
+
+        case 0x00:
+        case 0x4B:
+        case 0x4C:
+        case 0x4D:
+            return 1;
+    }
+    return -1;  // e.g. 0x99 resets to values only the firmware knows, 0xA0 stops the effect
+}
+
+/* Keeps the cached device state in step with a command sent as it is. */
+void trackState(struct pending_command cmd)
+{
+    if (state_known && deltaCommand(&device_state, &cmd) < 0)
+        state_known = 0;
+}
+
+/* Sends the pending commands, batched like on the command line. With the
+ * device state read first, only what changes it is sent.
+ */
+int flushPending()
+{
+    if (!deviceReady()) {
+        pending_count = 0;  // the desired state has them
+        return -1;
+    }
+
+    for (int i = 0; !state_known && state_queryable && i < pending_count; i++) {
+        if (stateParam(pending[i].opcode) >= 0 || pending[i].opcode == 0xB1 || pending[i].opcode == 0xC0) {
+            state_known = queryState(&device_state) == 0;
+            state_queryable = state_known;
+        }
+    }
+
+    for (int i = 0; i < pending_count; i++) {
+        if (state_known) {
+            int delta = deltaCommand(&device_state, &pending[i]);
+            if (delta == 0)
+                continue;
+            state_known = delta > 0;
+        }
+        queueCommand(pending[i].opcode, pending[i].params, pending[i].count);
+    }
+    pending_count = 0;
+
+    int status = flushCommands();
+    if (status != 0)
+        state_known = 0;    // not sure what arrived
+    return status;
+}
+
+/* Adds the commands of a payload to the pending ones, dropping the pending
+ * commands they make redundant.
+ */
+void addPending(const unsigned char *payload, int length)
+{
+    for (int i = 0; i + 2 <= length && i + 2 + payload[i + 1] <= length; i += 2 + payload[i + 1]) {
+        struct pending_command cmd = { payload[i], payload[i + 1], { 0 } };
+        memcpy(cmd.params, payload + i + 2, cmd.count);
+        rememberState(&cmd);
+
+        int kept = 0;
+        for (int j = 0; j < pending_count; j++) {
+            if (!supersedes(&cmd, &pending[j]))
+                pending[kept++] = pending[j];
+        }
+        pending_count = kept;
+
+        if (pending_count == SHORTYD_PENDING_MAX)
+            flushPending();
+        if (pending_count == 0)
+            pending_since = now_ms();
+        pending[pending_count++] = cmd;
+    }
+}
+
+/* Requests that want an answer go out right away, after everything pending. */
+void answerRequest(struct daemon_client *client, uint8_t flags, const unsigned char *payload, int length)
+{
+    unsigned char answer[1 + PROTO_PAYLOAD_MAX];
+    int ack = want_ack;
+    int size;
+
+    for (int i = 0; i + 2 <= length && i + 2 + payload[i + 1] <= length; i += 2 + payload[i + 1]) {
+        struct pending_command cmd = { payload[i], payload[i + 1], { 0 } };
+        memcpy(cmd.params, payload + i + 2, cmd.count);
+        rememberState(&cmd);
+    }
+
+    if (flushPending() < 0 && !deviceReady()) {
+        answer[0] = (flags & PROTO_FLAG_REPORT) ? 0 : 1;
+        answer[1] = 0xFF;
+        write_socket(client->fd, answer, 1 + answer[0]);
+        return;
+    }
+
+    for (int i = 0; i + 2 <= length && i + 2 + payload[i + 1] <= length; i += 2 + payload[i + 1]) {
+        struct pending_command cmd = { payload[i], payload[i + 1], { 0 } };
+        memcpy(cmd.params, payload + i + 2, cmd.count);
+        trackState(cmd);
+        queueCommand(payload[i], payload + i + 2, payload[i + 1]);
+    }
+
+    if (flags & PROTO_FLAG_REPORT) {
+        want_ack = 0;
+        flushCommands();
+        size = protocol == 1 ? -1 : readFrame(seq - 1, PROTO_FLAG_REPLY | PROTO_FLAG_REPORT, answer + 1, PROTO_PAYLOAD_MAX);
+    } else {
+        want_ack = 1;
+        int status = flushCommands();
+        if (status != 0)
+            state_known = 0;
+        answer[1] = status < 0 ? 0xFF : status;
+        size = 1;
+    }
+    want_ack = ack;
+
+    answer[0] = size < 0 ? 0 : size;
+    write_socket(client->fd, answer, 1 + answer[0]);
+}
+
+int LIBUSB_CALL hotplugEvent(libusb_context *ctx, libusb_device *device,
+                             libusb_hotplug_event event, void *user_data)
+{
+    (void)ctx;
+    (void)device;
+    (void)user_data;
+
+    /* no I/O in here, the main loop opens or closes the device */
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+        attach_at = 0;
+    else if (devh)
+        out_error = LIBUSB_ERROR_NO_DEVICE;
+    return 0;
+}
+
+/* Drops the device after it left or failed, and tries again once. */
+void detachDevice()
+{
+    fprintf(stderr, "Device gone, waiting for it\n");
+    closeDevice();
+    out_error = 0;
+    out_len = 0;
+    batch_len = 0;
+    ready_at = -1;
+    attach_at = now_ms() + SHORTYD_RETRY_MS;
+}
+
+/* Waits for the firmware to answer, opening the line may have reset it.
+ * Only for v2, v1 waits SHORTYD_BOOT_MS in the main loop instead.
+ */
+int handshake()
+{
+    int ack = want_ack;
+    int status = -1;
+    long start = now_ms();
+
+    want_ack = 1;
+    while (status != 0 && !out_error && now_ms() - start < SHORTYD_HANDSHAKE_MS) {
+        queueCommand(0x00, NULL, 0);
+        status = flushCommands();
+    }
+    want_ack = ack;
+    return status == 0 ? 0 : -1;
+}
+
+/* Drops a device that didn't come up and schedules the next attempt. */
+void failAttach(int rc)
+{
+    if (rc != LIBUSB_ERROR_NOT_FOUND)
+        fprintf(stderr, "Device not answering\n");
+    closeDevice();
+    out_error = 0;
+    out_len = 0;
+    batch_len = 0;
+    ready_at = -1;
+    /* hotplug reports the device arriving, not a device that failed */
+    attach_at = hotplug && rc == LIBUSB_ERROR_NOT_FOUND ? -1 : now_ms() + SHORTYD_RETRY_MS;
+}
+
+/* Replays the desired state to a device that is up. */
+void replayState()
+{
+    /* the desired state covers everything pending */
+    memcpy(pending, desired, sizeof(desired[0]) * desired_count);
+    pending_count = desired_count;
+    if (flushPending() >= 0 && !out_error) {
+        fprintf(stderr, "Device ready, state replayed\n");
+        attach_at = -1;
+        return;
+    }
+    failAttach(0);
+}
+
+/* Opens the device and replays the desired state once the firmware is up.
+ * Without replies to wait for, v1 gives it SHORTYD_BOOT_MS from the main
+ * loop, so the clients aren't kept waiting meanwhile.
+ */
+void attachDevice()
+{
+    int rc = openDevice();
+    state_known = 0;
+    state_queryable = 1;
+    if (rc != 0) {
+        failAttach(rc);
+    } else if (protocol == 1) {
+        attach_at = -1;
+        ready_at = now_ms() + SHORTYD_BOOT_MS;
+    } else if (handshake() == 0) {
+        replayState();
+    } else {
+        failAttach(rc);
+    }
+}
+
+/* Reads from a client and handles its complete requests, returns 0 once
+ * the client is gone or sent garbage.
+ */
+int serveClient(struct daemon_client *client)
+{
+    ssize_t count = read(client->fd, client->buffer + client->length,
+                         sizeof(client->buffer) - client->length);
+    if (count < 0 && errno == EINTR)
+        return 1;
+    if (count <= 0)
+        return 0;
+    client->length += count;
+
+    while (client->length >= 2) {
+        uint8_t flags = client->buffer[0];
+        int length = client->buffer[1];
+        if (length > PROTO_PAYLOAD_MAX)
+            return 0;
+        if (client->length < 2 + length)
+            break;
+
+        if (flags & (PROTO_FLAG_ACK | PROTO_FLAG_REPORT))
+            answerRequest(client, flags, client->buffer + 2, length);
+        else
+            addPending(client->buffer + 2, length);
+
+        client->length -= 2 + length;
+        memmove(client->buffer, client->buffer + 2 + length, client->length);
+    }
+    return 1;
+}
+
+/* Serves clients on the socket until SIGINT/SIGTERM or the device fails,
+ * returns the exit code.
+ */
+int runDaemon()
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct daemon_client clients[SHORTYD_CLIENTS];
+    struct pollfd fds[1 + SHORTYD_CLIENTS + SHORTYD_USB_FDS];
+    struct timeval no_wait = { 0, 0 };
+    libusb_hotplug_callback_handle hotplug_handle;
+    int client_count = 0;
+
+    socketPath(addr.sun_path, sizeof(addr.sun_path));
+
+    if (connectDaemon() == 0) {
+        fprintf(stderr, "shortyd is already running on %s\n", addr.sun_path);
+        close(daemon_fd);
+        daemon_fd = -1;
+        return 1;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+        return 1;
+    }
+
+    /* nobody answered on it, so a socket that is still there is a leftover */
+    unlink(addr.sun_path);
+    mode_t mask = umask(0077);
+    int rc = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (rc < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "Error listening on %s: %s\n", addr.sun_path, strerror(errno));
+        close(listen_fd);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stopDaemon);
+    signal(SIGTERM, stopDaemon);
+    fprintf(stderr, "shortyd listening on %s\n", addr.sun_path);
+
+    /* ENUMERATE reports a device that is already there right away */
+    if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        hotplug = libusb_hotplug_register_callback(NULL,
+                LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                LIBUSB_HOTPLUG_ENUMERATE, VENDOR_ID, PRODUCT_ID, LIBUSB_HOTPLUG_MATCH_ANY,
+                hotplugEvent, NULL, &hotplug_handle) == LIBUSB_SUCCESS;
+    }
+
+    while (daemon_running) {
+        if (out_error)
+            detachDevice();
+        if (!devh && attach_at >= 0 && now_ms() >= attach_at)
+            attachDevice();
+        if (devh && ready_at >= 0 && now_ms() >= ready_at) {
+            ready_at = -1;
+            replayState();
+        }
+
+        long wake = -1;
+        if (pending_count > 0)
+            wake = pending_since + SHORTYD_COALESCE_MS;
+        else if (devh && ready_at >= 0)
+            wake = ready_at;
+        else if (!devh && attach_at >= 0)
+            wake = attach_at;
+        int timeout = wake < 0 ? -1 : wake > now_ms() ? (int)(wake - now_ms()) : 0;
+
+        int polled = client_count;
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < polled; i++) {
+            fds[1 + i].fd = clients[i].fd;
+            fds[1 + i].events = POLLIN;
+        }
+
+        /* libusb's own fds wake us for hotplug events */
+        int usb_count = 0;
+        const struct libusb_pollfd **usb_fds = libusb_get_pollfds(NULL);
+        for (int i = 0; usb_fds && usb_fds[i] && usb_count < SHORTYD_USB_FDS; i++, usb_count++) {
+            fds[1 + polled + usb_count].fd = usb_fds[i]->fd;
+            fds[1 + polled + usb_count].events = usb_fds[i]->events;
+        }
+        libusb_free_pollfds(usb_fds);
+
+        int ready = poll(fds, 1 + polled + usb_count, timeout);
+        if (ready < 0 && errno != EINTR) {
+            fprintf(stderr, "Error polling: %s\n", strerror(errno));
+            break;
+        }
+
+        if (ready > 0 && (fds[0].revents & POLLIN)) {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0 && client_count < SHORTYD_CLIENTS) {
+                clients[client_count].fd = fd;
+                clients[client_count].length = 0;
+                client_count++;
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+
+        /* backwards, a client that is gone is replaced by the last one */
+        for (int i = polled - 1; ready > 0 && i >= 0; i--) {
+            if (!(fds[1 + i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            if (!serveClient(&clients[i])) {
+                close(clients[i].fd);
+                clients[i] = clients[--client_count];
+            }
+        }
+
+        if (pending_count > 0 && now_ms() - pending_since >= SHORTYD_COALESCE_MS)
+            flushPending();
+
+        libusb_handle_events_timeout_completed(NULL, &no_wait, NULL);
     }
 
+    if (hotplug)
+        libusb_hotplug_deregister_callback(NULL, hotplug_handle);
+    if (deviceReady() && !out_error)
+        flushPending();
+    for (int i = 0; i < client_count; i++)
+        close(clients[i].fd);
+    close(listen_fd);
+    unlink(addr.sun_path);
 
+    return 0;
+}
+
+/* Runs the commands given on the command line, returns the exit code. */
+int runCommands(int argc, char **argv)
+{
     uint8_t state;
     uint8_t index;
     uint8_t color;
     uint8_t speed;
+    int count;
+    uint32_t frame_colors[BUTTON_COUNT];
     char* nextArg = "";
 
     for (int i=0; i<argc; i++) {
@@ -242,21 +1873,155 @@ int main(int argc, char **argv)
                 setButton(index, state, color);
                 break;
 
+            case 'l':
+                nextArg = getArg(i + 1, argc, argv);
+                if (isNumeric(nextArg) && atoi(nextArg) <= 255) {
+                    setBrightness(atoi(nextArg));
+                    i++;
+                }
+                break;
+
+            case 'q':
+                printState();
+                break;
+
+            case 'k':
+                nextArg = getArg(i + 1, argc, argv);
+                if (isNumeric(nextArg) && i + 2 < argc) {
+                    int hold = strcmp(getArg(i + 3, argc, argv), "hold") == 0;
+                    setKey(atoi(nextArg), argv[i + 2], hold);
+                    i += 2 + hold;
+                } else {
+                    printKeymap();
+                }
+                break;
+
+            case 'm':
+                nextArg = getArg(i + 1, argc, argv);
+                if (isNumeric(nextArg) && i + 2 < argc) {
+                    setMacro(atoi(nextArg), argv[i + 2]);
+                    i += 2;
+                }
+                break;
+
+            case 'S':
+                count = 30;
+                nextArg = getArg(i + 1, argc, argv);
+                if (atoi(nextArg) > 0) {
+                    count = atoi(nextArg);
+                    i++;
+                }
+                streamFrames(count);
+                break;
+
+            case 'f':
+                memset(frame_colors, 0, sizeof(frame_colors));
+                for (int b = 0; b < BUTTON_COUNT; b++) {
+                    nextArg = getArg(i + 1, argc, argv);
+                    if (!isColor(nextArg))
+                        break;
+                    frame_colors[b] = parseColor(nextArg);
+                    i++;
+                }
+                setFrame(frame_colors);
+                break;
+
+            case '-':
+                if (strcmp(argv[i], "-B") == 0) {
+                    i++;
+                } else if (strcmp(argv[i], "--bench") == 0) {
+                    count = 1000;
+                    nextArg = getArg(i + 1, argc, argv);
+                    if (atoi(nextArg) > 0) {
+                        count = atoi(nextArg);
+                        i++;
+                    }
+                    benchCommands(count);
+                }
+                break;
+
+            case 't':
+                flushCommands();
+                count = 500;
+                nextArg = getArg(i + 1, argc, argv);
+                if (atoi(nextArg) > 0) {
+                    count = atoi(nextArg);
+                    i++;
+                }
+                throughputTest(count);
+                break;
+
             case 's':
                 nextArg = getArg(i + 1, argc, argv);
                 // fprintf(stdout, "sleep \"%s\"\n", nextArg);
                 if (atoi(nextArg) > 0) {
+                    flushCommands();
                     sleep(atoi(nextArg));
                     i++;
                 }
                 break;
         }
     }
-    libusb_release_interface(devh, 0);
+    if (flushCommands() != 0)
+        return 1;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int rc;
+    const char *name = strrchr(argv[0], '/');
+    int daemon_mode = strcmp(name ? name + 1 : argv[0], "shortyd") == 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-B") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            baud = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-1") == 0) {
+            protocol = 1;
+        } else if (strcmp(argv[i], "-2") == 0) {
+            protocol = 2;   // only for a 16U2 firmware with the fast link
+        } else if (strcmp(argv[i], "-a") == 0) {
+            want_ack = 1;   // wait for ACKs, retry on NAK or timeout
+        } else if (strcmp(argv[i], "--daemon") == 0) {
+            daemon_mode = 1;
+        }
+    }
+
+    /* with shortyd running the device is its, the commands go through it */
+    if (!daemon_mode && connectDaemon() == 0) {
+        rc = runCommands(argc, argv);
+        close(daemon_fd);
+        return rc;
+    }
+
+    if (want_ack && protocol == 1) {
+        fprintf(stderr, "ACKs need protocol v2 (-2), sending without\n");
+        want_ack = 0;
+    }
+
+    /* Initialize libusb
+     */
+    rc = libusb_init(NULL);
+    if (rc < 0) {
+        fprintf(stderr, "Error initializing libusb: %s\n", libusb_error_name(rc));
+        exit(1);
+    }
+
+    /* Set debugging output to max level.
+     */
+    // libusb_set_debug(NULL, 3);
+
+    /* shortyd waits for the device itself */
+    if (daemon_mode) {
+        rc = runDaemon();
+    } else {
+        rc = openDevice();
+        if (rc == LIBUSB_ERROR_NOT_FOUND)
+            fprintf(stderr, "Error finding USB device\n");
+        rc = rc < 0 ? 1 : runCommands(argc, argv);
+    }
 
-out:
-    if (devh)
-            libusb_close(devh);
+    closeDevice();
     libusb_exit(NULL);
     return rc;
 }
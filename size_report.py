@@ -0,0 +1,63 @@
+# PlatformIO extra script, adds a target that lists RAM and flash use per module:
+#
+#   pio run -t size_report
+#
+# Symbols are grouped by the file they are defined in, or by class for
+# symbols without line info. .data counts for RAM and flash, .bss for RAM only.
+
+import collections
+import os
+import subprocess
+
+Import("env")
+
+# line info for grouping by file, it doesn't end up in the hex
+env.Append(CCFLAGS=["-g"])
+
+
+def module_of(name, location):
+    if location:
+        return os.path.basename(location.rsplit(":", 1)[0])
+    if "::" in name:
+        return name.split("(")[0].rsplit("::", 1)[0].split("<")[0]
+    return "(globals)"
+
+
+def size_report(target, source, env):
+    elf = env.subst("$BUILD_DIR/${PROGNAME}.elf")
+    nm = env.subst("$CC").replace("gcc", "nm")
+    output = subprocess.check_output(
+        [nm, "--print-size", "--size-sort", "--demangle", "--line-numbers", elf],
+        universal_newlines=True)
+
+    flash = collections.Counter()
+    ram = collections.Counter()
+    for line in output.splitlines():
+        symbol, _, location = line.partition("\t")
+        fields = symbol.split(None, 3)
+        if len(fields) < 4:
+            continue
+        size = int(fields[1], 16)
+        kind = fields[2].lower()
+        module = module_of(fields[3], location)
+
+        if kind in "tw":
+            flash[module] += size
+        elif kind in "dv":
+            flash[module] += size
+            ram[module] += size
+        elif kind == "b":
+            ram[module] += size
+
+    print("%-32s %8s %8s" % ("module", "flash", "ram"))
+    for module in sorted(set(flash) | set(ram), key=lambda m: -(ram[m] * 16 + flash[m])):
+        print("%-32s %8d %8d" % (module, flash[module], ram[module]))
+    print("%-32s %8d %8d" % ("total", sum(flash.values()), sum(ram.values())))
+
+
+env.AddCustomTarget(
+    name="size_report",
+    dependencies="$BUILD_DIR/${PROGNAME}.elf",
+    actions=size_report,
+    title="Size report",
+    description="RAM and flash use per module")
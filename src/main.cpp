@@ -1,27 +1,44 @@
 #include <Arduino.h>
+#include <BoardConfig.h>
 #include <USBKeyboard.h>
-#include <LightweightRingBuff.h>
-#include <JC_Button.h>
-#include <Encoder.h>
+#include <SerialParser.h>
+#include <LoopScheduler.h>
+#include <PixelAnimations.h>
+#include <ButtonEvents.h>
+#include <RotaryEncoder.h>
+#include <MacroEngine.h>
+#include <StateStore.h>
 
 #include <Adafruit_NeoPixel.h>
-#include <WS2812FX.h>
+#include <PixelOutput.h>
+#include <FrameBuffer.h>
+#include <Compositor.h>
+#include <EffectEngine.h>
 
 // #define DEBUG_LOG
-// #define DEBUG_SERIAL
-
-#define BUTTON_COUNT 6
-#define PIN_BTN_A   4
-#define PIN_BTN_B   3
-#define PIN_BTN_C   2
-#define PIN_BTN_D   7
-#define PIN_BTN_E   6
-#define PIN_BTN_F   5
-
-#define PIN_ROTARY_CLK 11
-#define PIN_ROTARY_DT 10
-
-#define PIN_NEOPIXELS 9
+// #define DEBUG_SERIAL // SoftwareSerial defines all PCINT vectors, clashes with the button and rotary ISRs
+
+// pins and button count come from the board description in BoardConfig.h
+static_assert(BUTTON_COUNT <= BUTTON_EVENTS_MAX, "too many buttons for ButtonEvents");
+static_assert(BUTTON_COUNT <= FRAMEBUFFER_MAX, "too many buttons for FrameBuffer");
+static_assert(BUTTON_COUNT <= COMPOSITOR_PIXELS, "too many buttons for Compositor");
+static_assert(COMBO_HOLD < BUTTON_COUNT && COMBO_BACKLIGHT < BUTTON_COUNT && COMBO_EFFECT_NEXT < BUTTON_COUNT
+              && COMBO_EFFECT_OFF < BUTTON_COUNT && COMBO_COLOR < BUTTON_COUNT && COMBO_SPEED < BUTTON_COUNT,
+              "combo buttons outside the board");
+
+// task periods in µs
+#define PERIOD_ROTARY   1000
+#define PERIOD_BUTTONS  2000
+#define PERIOD_LEDS     10000
+#define PERIOD_STATE    10000
+
+#define FLASH_DURATION 80 // ms
+#define LED_MAX_FPS 60
+#define STREAM_FPS 30
+#define STREAM_TIMEOUT 2000 // ms without frames before streaming stops
+#define STATE_VERSION 1 // bump when DeviceState changes
+#define KEYMAP_VERSION 1 // bump when KeymapState changes
+#define KEYMAP_WRITE_DELAY 500 // ms, lets a host send the whole keymap first
 
 #if defined(DEBUG_LOG) && defined(DEBUG_SERIAL)
 #include <SoftwareSerial.h>
@@ -30,29 +47,64 @@
 #define Debug Serial
 #endif
 
-#define DIM_75(c) (uint32_t)(((c >> 1) + c) & 0x3f3f3f3f)
+// KEY_CHORD(MOD_CONTROL_LEFT | MOD_SHIFT_LEFT, KEY_M) sends modifiers and key in one report
+// short presses first, then long presses, see defaultKeymap()
+uint16_t button_keys[BUTTON_COUNT * 2];
+
+// hold buttons keep their short press key down while pressed, e.g. for push-to-talk
+bool buttons_hold[BUTTON_COUNT] = { false };
+static_assert(BUTTON_COUNT <= 8, "buttons_hold is saved as a bit per button");
 
-byte button_pins[] = {PIN_BTN_A, PIN_BTN_B, PIN_BTN_C,
-                        PIN_BTN_D, PIN_BTN_E, PIN_BTN_F};
+EdgeButton buttons[BUTTON_COUNT];
 
-int button_keys[] = { KEY_F13, KEY_F14, KEY_F15, KEY_F16, KEY_F17, KEY_F18,  // short presses
-                        KEY_F19, KEY_F20, KEY_F21, KEY_F22, KEY_F23, KEY_F24 };  // long presses
+static_assert(buttonsOnPort<BOARD>('D'), "ISR(PCINT2_vect) only sees buttons on port D");
+ISR(PCINT2_vect) {
+    ButtonInput.capture();
+}
+
+bool buttons_suppressed[BUTTON_COUNT] = { false };
+bool buttons_lit[BUTTON_COUNT] = { false };
 
-Button buttons[] = { Button(PIN_BTN_A), Button(PIN_BTN_B), Button(PIN_BTN_C),
-                     Button(PIN_BTN_D), Button(PIN_BTN_E), Button(PIN_BTN_F), };
+RotaryEncoder rotary;
+
+static_assert(pinPort(PIN_ROTARY_CLK) == 'B' && pinPort(PIN_ROTARY_DT) == 'B',
+              "ISR(PCINT0_vect) only sees the rotary on port B");
+ISR(PCINT0_vect) {
+    rotary.update();
+}
 
-bool buttons_suppressed[] = { false, false, false, false, false, false };
-bool buttons_lit[] = { false, false, false, false, false, false };
+uint16_t rotary_key_cw = KEY_VOLUME_UP;
+uint16_t rotary_key_ccw = KEY_VOLUME_DOWN;
 
-Encoder rotary(PIN_ROTARY_DT, PIN_ROTARY_CLK);
-int rotary_pos=0;
-int rotary_key_cw = KEY_VOLUME_UP;
-int rotary_key_ccw = KEY_VOLUME_DOWN;
+#define EFFECT_PIXELS (BUTTON_COUNT - 1) // the effects leave the last pixel of the strip alone
+
+// compositor layers from the bottom up, each one also has its own brightness
+enum Layer : uint8_t {
+    LAYER_BACKLIGHT,
+    LAYER_EFFECT,
+    LAYER_HIGHLIGHT,    // lit and streamed buttons
+    LAYER_PRESS,        // pressed buttons
+    LAYER_NOTIFY        // short flashes on top of everything
+};
+static_assert(LAYER_NOTIFY < COMPOSITOR_LAYERS, "too many layers for Compositor");
+
+// in perceived brightness, the global brightness scales all of them
+#define BRIGHTNESS_BUTTON    74
+#define BRIGHTNESS_BACKLIGHT 66
+#define BRIGHTNESS_EFFECT    152
 
 Adafruit_NeoPixel pixels(BUTTON_COUNT, PIN_NEOPIXELS, NEO_GRB + NEO_KHZ800);
+PixelOutput output(pixels);
+FrameBuffer frame(output, BUTTON_COUNT);
+Compositor compositor(frame, BUTTON_COUNT);
 
-int colors_count = 7;
-uint32_t colors[] = {
+void writeEffectPixel(uint8_t index, uint32_t color) {
+    compositor.set(LAYER_EFFECT, index, color);
+}
+
+EffectEngine fx(writeEffectPixel, 0, EFFECT_PIXELS);
+
+const uint32_t colors[] PROGMEM = {
     BLUE,
     CYAN,
     GREEN,
@@ -61,26 +113,44 @@ uint32_t colors[] = {
     MAGENTA,
     WHITE
 };
+constexpr uint8_t colors_count = sizeof(colors) / sizeof(colors[0]);
+
+uint32_t paletteColor(uint8_t index) {
+    return pgm_read_dword(&colors[index]);
+}
 
 bool backlight = false;
-int backlight_color = colors_count - 1;
+uint8_t backlight_color = colors_count - 1;
 
-uint32_t color_default = pixels.Color(70, 70, 70);
 uint32_t color_off = pixels.Color(0, 0, 0);
 
-int button_pixels[] = {
-    0, 1, 2,
-    5, 4, 3
-};
-int button_colors[] = { 0, 0, 0, 0, 0, 0 };
+int8_t button_colors[BUTTON_COUNT] = { 0 };
+
+#define COLOR_RGB -1 // button_colors entry that uses button_rgb instead of the palette
+uint32_t button_rgb[BUTTON_COUNT] = { 0 };
+uint8_t rgb_partial[BUTTON_COUNT * 3]; // RGB frame coming in over v1, one button at a time
+
+PixelAnimations animations;
+LoopScheduler scheduler;
+MacroEngine macros;
+
+// host streamed frames, the host fills one buffer while the other is shown
+bool stream_active = false;
+uint8_t stream_buffers[2][BUTTON_COUNT * 3];
+uint8_t stream_partial[BUTTON_COUNT * 3]; // frame coming in over v1, one button at a time
+uint8_t stream_front = 0;
+bool stream_back_ready = false;
+uint8_t stream_expected = 0;
+uint32_t stream_last_frame = 0;
+uint16_t stream_presented = 0;
+uint16_t stream_dropped = 0;
+uint16_t stream_late = 0;
 
-WS2812FX pixels_effect = WS2812FX(BUTTON_COUNT - 1, PIN_NEOPIXELS, NEO_GRB + NEO_KHZ800);
 bool effect_active = false;
-int effect_color = 0;
-uint32_t effect_speed = 3000;
+uint8_t effect_color = 0;
+uint16_t effect_speed = 3000;
 
-int effects_count = 6;
-int effects[] = {
+const uint8_t effects[] PROGMEM = {
     FX_MODE_BREATH,
     FX_MODE_RAINBOW,
     FX_MODE_FIRE_FLICKER,
@@ -88,60 +158,73 @@ int effects[] = {
     FX_MODE_SCAN,
     FX_MODE_CHASE_COLOR
 };
-int effect_index = 0;
+constexpr uint8_t effects_count = sizeof(effects);
+uint8_t effect_index = 0;
+
+uint8_t effectMode(uint8_t index) {
+    return pgm_read_byte(&effects[index]);
+}
 
-int boot_anim = 7700;
+uint16_t boot_anim = 7700; // ms after boot
 
 bool led_latch_handled = false;
 
 
-void setPixelColor(int button, uint32_t color) {
-    pixels.setPixelColor(button_pixels[button], color);
+/* The notification layer follows the running animation of a button. */
+void renderNotification(uint8_t button) {
+    uint8_t pixel = buttonPixel(button);
+    if (animations.isActive(button)) {
+        compositor.set(LAYER_NOTIFY, pixel, animations.apply(button, compositor.composite(pixel, LAYER_NOTIFY)));
+    } else {
+        compositor.clear(LAYER_NOTIFY, pixel);
+    }
+}
+
+void renderNotifications() {
+    for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
+        if (compositor.covers(LAYER_NOTIFY, buttonPixel(i))) renderNotification(i);
+    }
 }
 
 void flashPixel(int button, uint32_t color) {
     if (effect_active) return;
-    setPixelColor(button, color);
-    pixels.show();
-    delay(80);
+    animations.start(button, ANIM_FLASH, color, FLASH_DURATION);
+    renderNotification(button);
 }
 
 void nextBacklightColor() {
     backlight_color = (backlight_color + 1) % colors_count;
 #ifdef DEBUG_LOG
-    Debug.print("backlight color "); Debug.print(backlight_color); Debug.print(" 0x"); Debug.println(colors[backlight_color], HEX);
+    Debug.print("backlight color "); Debug.print(backlight_color); Debug.print(" 0x"); Debug.println(paletteColor(backlight_color), HEX);
 #endif
 }
 
-void setupEffects() {
-    pixels_effect.init();
-    pixels_effect.setColor(colors[effect_color]);
-    pixels_effect.setSpeed(effect_speed);
-    pixels_effect.setMode(effects[effect_index]);
+void applyEffect() {
+    fx.setMode(effectMode(effect_index));
+    fx.setColor(paletteColor(effect_color));
+    fx.setSpeed(effect_speed);
+
+    // special defaults for some effects
+    if (effectMode(effect_index) == FX_MODE_FIRE_FLICKER) {
+        fx.setColor(RED);
+        fx.setSpeed(1000);
+    } else if (effectMode(effect_index) == FX_MODE_RAINBOW) {
+        fx.setSpeed(8000);
+    } else if (effectMode(effect_index) == FX_MODE_SCAN && effect_speed > 2000) {
+        fx.setSpeed(2000);
+    } else if (effectMode(effect_index) == FX_MODE_CHASE_COLOR && effect_speed > 2000) {
+        fx.setSpeed(2000);
+    }
 }
 
-void setEffect(int index) {
+void setEffect(uint8_t index) {
     if (effect_index == index) return;
 
     effect_index = index;
-    pixels_effect.setMode(effects[effect_index]);
-    pixels_effect.setColor(colors[effect_color]);
-    pixels_effect.setSpeed(effect_speed);
-
-    // special defaults for some effects
-    if (effects[effect_index] == FX_MODE_FIRE_FLICKER) {
-        pixels_effect.setColor(RED);
-        pixels_effect.setSpeed(1000);
-    } else if (effects[effect_index] == FX_MODE_RAINBOW) {
-        pixels_effect.setSpeed(8000);
-    } else if (effects[effect_index] == FX_MODE_SCAN && effect_speed > 2000) {
-        pixels_effect.setSpeed(2000);
-    } else if (effects[effect_index] == FX_MODE_CHASE_COLOR && effect_speed > 2000) {
-        pixels_effect.setSpeed(2000);
-    }
+    applyEffect();
 
 #ifdef DEBUG_LOG
-    Debug.print("effect mode "); Debug.print(effect_index); Debug.print(" "); Debug.print(effects[effect_index]); Debug.print(" "); Debug.println(pixels_effect.getModeName(effects[effect_index]));
+    Debug.print("effect mode "); Debug.print(effect_index); Debug.print(" "); Debug.print(effectMode(effect_index)); Debug.print(" "); Debug.println((const __FlashStringHelper *)EffectEngine::getModeName(effectMode(effect_index)));
 #endif
 }
 
@@ -153,24 +236,28 @@ void startEffect() {
     if (effect_active) return;
 
     effect_active = true;
-    pixels.setBrightness(66);
-    pixels_effect.start();
+    fx.start();
 }
 
 void stopEffect() {
     if (!effect_active) return;
     effect_active = false;
-    pixels_effect.stop();
-    pixels.setBrightness(10);
+    fx.pause();
+    compositor.clearLayer(LAYER_EFFECT);
 }
 
-void setEffectColor(int index) {
+/* Brightness changes only push the stored colors again, nothing is rendered anew. */
+void setBrightness(uint8_t level) {
+    if (output.setBrightness(level)) frame.invalidate();
+}
+
+void setEffectColor(uint8_t index) {
     if (effect_color == index) return;
 
     effect_color = index;
-    pixels_effect.setColor(colors[effect_color]);
+    fx.setColor(paletteColor(effect_color));
 #ifdef DEBUG_LOG
-    Debug.print("effect color "); Debug.print(effect_color); Debug.print(" 0x"); Debug.println(colors[effect_color], HEX);
+    Debug.print("effect color "); Debug.print(effect_color); Debug.print(" 0x"); Debug.println(paletteColor(effect_color), HEX);
 #endif
 }
 
@@ -182,7 +269,7 @@ void setEffectSpeed(int speed) {
     if (effect_speed == speed || speed < 1000 || speed > 10000) return;
 
     effect_speed = speed;
-    pixels_effect.setSpeed(effect_speed);
+    fx.setSpeed(effect_speed);
 #ifdef DEBUG_LOG
     Debug.print("effect speed "); Debug.println(effect_speed);
 #endif
@@ -193,7 +280,7 @@ void nextEffectSpeed() {
 }
 
 void reset() {
-    for (int i = 0; i < BUTTON_COUNT; i++) {
+    for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
         buttons_lit[i] = false;
         button_colors[i] = 0;
     }
@@ -205,6 +292,138 @@ void reset() {
     effect_speed = 3000;
 }
 
+/*
+ * Lighting state that survives a power cycle. Host RGB frames and streams
+ * are left out, they are driven by the host and change far too often.
+ */
+struct DeviceState {
+    uint8_t buttons_lit;    // bit per button
+    int8_t button_colors[BUTTON_COUNT];
+    uint8_t flags;
+    uint8_t backlight_color;
+    uint8_t effect_index;
+    uint8_t effect_color;
+    uint16_t effect_speed;
+};
+
+#define STATE_BACKLIGHT (1 << 0)
+#define STATE_EFFECT    (1 << 1)
+
+static_assert(sizeof(DeviceState) <= STATE_PAYLOAD_MAX, "DeviceState too large for StateStore");
+static_assert(sizeof(DeviceState) + 2 <= EEPROM_STATE_SIZE, "no room for a DeviceState record");
+StateStore state_store(EEPROM_STATE_START, EEPROM_STATE_SIZE, sizeof(DeviceState), STATE_VERSION);
+
+void snapshotState(DeviceState &state) {
+    memset(&state, 0, sizeof(DeviceState));
+    for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
+        if (button_colors[i] == COLOR_RGB) continue;
+        if (buttons_lit[i]) state.buttons_lit |= 1 << i;
+        state.button_colors[i] = button_colors[i];
+    }
+    if (backlight) state.flags |= STATE_BACKLIGHT;
+    if (effect_active) state.flags |= STATE_EFFECT;
+    state.backlight_color = backlight_color;
+    state.effect_index = effect_index;
+    state.effect_color = effect_color;
+    state.effect_speed = effect_speed;
+}
+
+bool restoreState() {
+    DeviceState state;
+    if (!state_store.load(&state)) return false;
+
+    if (state.backlight_color >= colors_count || state.effect_index >= effects_count
+            || state.effect_color >= colors_count
+            || state.effect_speed < 1000 || state.effect_speed > 10000) {
+        return false;
+    }
+    for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
+        if (state.button_colors[i] < 0 || state.button_colors[i] >= colors_count) return false;
+    }
+
+    for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
+        buttons_lit[i] = state.buttons_lit & (1 << i);
+        button_colors[i] = state.button_colors[i];
+    }
+    backlight = state.flags & STATE_BACKLIGHT;
+    backlight_color = state.backlight_color;
+    effect_index = state.effect_index;
+    effect_color = state.effect_color;
+    effect_speed = state.effect_speed;
+    applyEffect();
+    if (state.flags & STATE_EFFECT) startEffect();
+
+#ifdef DEBUG_LOG
+    Debug.println("state restored");
+#endif
+    return true;
+}
+
+/* Keys set over serial, kept apart from DeviceState since they rarely change. */
+struct KeymapState {
+    uint16_t button_keys[BUTTON_COUNT * 2];
+    uint16_t rotary_keys[2];
+    uint8_t buttons_hold;   // bit per button
+};
+
+static_assert(sizeof(KeymapState) <= STATE_PAYLOAD_MAX, "KeymapState too large for StateStore");
+static_assert(sizeof(KeymapState) + 2 <= EEPROM_KEYMAP_SIZE, "no room for a KeymapState record");
+StateStore keymap_store(EEPROM_KEYMAP_START, EEPROM_KEYMAP_SIZE, sizeof(KeymapState), KEYMAP_VERSION,
+                        KEYMAP_WRITE_DELAY);
+
+void snapshotKeymap(KeymapState &keymap) {
+    memcpy(keymap.button_keys, button_keys, sizeof(keymap.button_keys));
+    keymap.rotary_keys[0] = rotary_key_cw;
+    keymap.rotary_keys[1] = rotary_key_ccw;
+    keymap.buttons_hold = 0;
+    for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
+        if (buttons_hold[i]) keymap.buttons_hold |= 1 << i;
+    }
+}
+
+bool restoreKeymap() {
+    KeymapState keymap;
+    if (!keymap_store.load(&keymap)) return false;
+
+    memcpy(button_keys, keymap.button_keys, sizeof(keymap.button_keys));
+    rotary_key_cw = keymap.rotary_keys[0];
+    rotary_key_ccw = keymap.rotary_keys[1];
+    for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
+        buttons_hold[i] = keymap.buttons_hold & (1 << i);
+    }
+    return true;
+}
+
+/* F13-F18 on the short and F19-F24 on the long presses, buttons past the sixth start unbound */
+void defaultKeymap() {
+    for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
+        button_keys[i] = i < 6 ? KEY_F13 + i : 0;
+        button_keys[BUTTON_COUNT + i] = i < 6 ? KEY_F19 + i : 0;
+    }
+}
+
+/* 1-6 short press, 7-12 long press, 13 rotary clockwise, 14 counter-clockwise */
+uint16_t *keymapEntry(uint8_t index) {
+    if (index >= 1 && index <= BUTTON_COUNT * 2) return &button_keys[index - 1];
+    if (index == BUTTON_COUNT * 2 + 1) return &rotary_key_cw;
+    if (index == BUTTON_COUNT * 2 + 2) return &rotary_key_ccw;
+    return NULL;
+}
+
+void setKey(uint8_t index, uint8_t mods, uint8_t key, bool hold) {
+    uint16_t *entry = keymapEntry(index);
+
+    if (index <= BUTTON_COUNT) {
+        int button = index - 1;
+        // don't leave the old key stuck down
+        if (buttons_hold[button] && buttons[button].isPressed()) {
+            Keyboard.release(CHORD_KEY(*entry), CHORD_MODS(*entry));
+        }
+        buttons_hold[button] = hold;
+    }
+    *entry = KEY_CHORD(mods, key);
+}
+
 /*
  * commands:
  * 0    change backlight
@@ -256,12 +475,12 @@ void handleLedStatus(uint8_t led_status) {
             backlight_color = colors_count - 1;
         }
 
-    } else if (command >= 1 && command <= 6) { // 0bX001 - 0bX110 button on/next/off
+    } else if (command >= 1 && command <= BUTTON_COUNT && command <= 6) { // 0bX001 - 0bX110 button on/next/off, 7 is the effect
         if (param && !buttons_lit[command - 1]) { // turn on
             buttons_lit[command - 1] = true;
         } else if (param) { // already on, next color
             button_colors[command - 1]++;
-            if (button_colors[command - 1] > colors_count - 1) button_colors[command - 1] = 0;
+            if (button_colors[command - 1] > colors_count - 1 || button_colors[command - 1] < 0) button_colors[command - 1] = 0;
 
         } else if (buttons_lit[command - 1]) { // not off, turn off
             buttons_lit[command - 1] = false;
@@ -283,18 +502,39 @@ void handleLedStatus(uint8_t led_status) {
     }
 }
 
-void sendButtonKey(int index){
+void sendButtonKey(uint8_t index){
 #if defined(DEBUG_LOG) && !defined(DEBUG_SERIAL)
     Debug.print("key "); Debug.println(button_keys[index]);
 #endif
+    // presses past the EEPROM_MACRO_SLOTS slots, on boards of more than 6 buttons, have no macro
+    if (macros.exists(index)) {
+        macros.start(index);
+        return;
+    }
     if (button_keys[index] == 0) return;
-    Keyboard.sendKeyStroke(button_keys[index]);
+    Keyboard.sendKeyStroke(CHORD_KEY(button_keys[index]), CHORD_MODS(button_keys[index]));
+}
+
+/*
+ * Hold buttons press and release their key with the button. This runs
+ * before the combos, so a release is never swallowed by one.
+ */
+void handleHoldButtons() {
+    for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
+        if (!buttons_hold[i]) continue;
+
+        if (buttons[i].wasPressed()) {
+            Keyboard.press(CHORD_KEY(button_keys[i]), CHORD_MODS(button_keys[i]));
+        } else if (buttons[i].wasReleased()) {
+            Keyboard.release(CHORD_KEY(button_keys[i]), CHORD_MODS(button_keys[i]));
+        }
+    }
 }
 
 bool handleButtonCombos() {
-    if (buttons[3].isPressed() && buttons[0].wasReleased()) {
+    if (buttons[COMBO_HOLD].isPressed() && buttons[COMBO_BACKLIGHT].wasReleased()) {
         backlight = !backlight;
-        buttons_suppressed[3] = true;
+        buttons_suppressed[COMBO_HOLD] = true;
 
 #ifdef DEBUG_LOG
         Debug.print("backlight switched "); Debug.println(backlight?"on":"off");
@@ -302,10 +542,10 @@ bool handleButtonCombos() {
         return true;
     }
 
-    if (buttons[3].isPressed() && buttons[5].wasReleased()) {
+    if (buttons[COMBO_HOLD].isPressed() && buttons[COMBO_EFFECT_NEXT].wasReleased()) {
         if (effect_active) nextEffect();
         else startEffect();
-        buttons_suppressed[3] = true;
+        buttons_suppressed[COMBO_HOLD] = true;
 
 #ifdef DEBUG_LOG
         Debug.println("effect switched on");
@@ -313,9 +553,9 @@ bool handleButtonCombos() {
         return true;
     }
 
-    if (buttons[3].isPressed() && buttons[4].wasReleased()) {
+    if (buttons[COMBO_HOLD].isPressed() && buttons[COMBO_EFFECT_OFF].wasReleased()) {
         stopEffect();
-        buttons_suppressed[3] = true;
+        buttons_suppressed[COMBO_HOLD] = true;
 
 #ifdef DEBUG_LOG
         Debug.println("effect switched off");
@@ -323,29 +563,75 @@ bool handleButtonCombos() {
         return true;
     }
 
-    if (effect_active && buttons[3].isPressed() && buttons[2].wasReleased()) {
+    if (effect_active && buttons[COMBO_HOLD].isPressed() && buttons[COMBO_COLOR].wasReleased()) {
         nextEffectColor();
-        buttons_suppressed[3] = true;
+        buttons_suppressed[COMBO_HOLD] = true;
         return true;
     }
 
-    if (effect_active && buttons[3].isPressed() && buttons[1].wasReleased()) {
+    if (effect_active && buttons[COMBO_HOLD].isPressed() && buttons[COMBO_SPEED].wasReleased()) {
         nextEffectSpeed();
-        buttons_suppressed[3] = true;
+        buttons_suppressed[COMBO_HOLD] = true;
         return true;
     }
 
-    if (backlight && buttons[3].isPressed() && buttons[2].wasReleased()) {
+    if (backlight && buttons[COMBO_HOLD].isPressed() && buttons[COMBO_COLOR].wasReleased()) {
         nextBacklightColor();
-        buttons_suppressed[3] = true;
+        buttons_suppressed[COMBO_HOLD] = true;
         return true;
     }
 
     return false;
 }
 
-void handleButton(int i) {
-    if (buttons[i].pressedFor(1000) && !buttons_suppressed[i]) {
+uint32_t buttonColor(uint8_t i) {
+    if (button_colors[i] == COLOR_RGB) return button_rgb[i];
+    return paletteColor(button_colors[i]);
+}
+
+uint32_t streamColor(uint8_t i) {
+    const uint8_t *rgb = stream_buffers[stream_front] + i * 3;
+    return pixels.Color(rgb[0], rgb[1], rgb[2]);
+}
+
+/*
+ * Puts the state of a button into its layers. Only what changed gets
+ * composed again, so this is cheap to call after any state change.
+ */
+void renderButton(uint8_t i) {
+    uint8_t pixel = buttonPixel(i);
+
+    if (backlight) {
+        compositor.set(LAYER_BACKLIGHT, pixel, paletteColor(backlight_color));
+    } else {
+        compositor.clear(LAYER_BACKLIGHT, pixel);
+    }
+
+    if (stream_active) {
+        compositor.set(LAYER_HIGHLIGHT, pixel, streamColor(i));
+    } else if (buttons_lit[i]) {
+        compositor.set(LAYER_HIGHLIGHT, pixel, buttonColor(i));
+    } else {
+        compositor.clear(LAYER_HIGHLIGHT, pixel);
+    }
+
+    if (buttons[i].isPressed()) {
+        compositor.set(LAYER_PRESS, pixel, BLUE);
+    } else {
+        compositor.clear(LAYER_PRESS, pixel);
+    }
+}
+
+void renderButtons() {
+    for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
+        renderButton(i);
+    }
+}
+
+void handleButton(uint8_t i) {
+    if (buttons_hold[i]) {
+        // handled by handleHoldButtons()
+    } else if (buttons[i].pressedFor(1000) && !buttons_suppressed[i]) {
 #ifdef DEBUG_LOG
         Debug.print("long-press "); Debug.println(i);
 #endif
@@ -356,27 +642,11 @@ void handleButton(int i) {
 
     } else if (buttons[i].wasReleased() && !buttons_suppressed[i]) {
 #ifdef DEBUG_LOG
-        Debug.print("press "); Debug.println(i);
+        Debug.print("press "); Debug.print(i); Debug.print(" held "); Debug.println(buttons[i].heldFor());
 #endif
 
         sendButtonKey(i);
         flashPixel(i, CYAN);
-
-    } else if (buttons[i].isPressed()) {
-        setPixelColor(i, BLUE);
-
-    } else if (buttons_lit[i]) {
-        setPixelColor(i, colors[button_colors[i]]);
-
-    } else if(effect_active) {
-        //skip
-
-    } else if(backlight) {
-        setPixelColor(i, DIM_75(colors[backlight_color]));
-
-    } else {
-        setPixelColor(i, color_off);
-
     }
 
     if (buttons[i].wasReleased()) {
@@ -385,42 +655,49 @@ void handleButton(int i) {
 }
 
 void handleButtons() {
-    for (int i = 0; i < BUTTON_COUNT; i++) {
-        buttons[i].read();
-    }
+    ButtonInput.read();
+    handleHoldButtons();
 
-    if (handleButtonCombos()){
-        return;
+    if (handleButtonCombos()) {
+        renderButtons();
+    } else {
+        for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
+            handleButton(i);
+        }
     }
 
-    for (int i = 0; i < BUTTON_COUNT; i++) {
-        handleButton(i);
+    for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
+        if (buttons[i].wasPressed() || buttons[i].wasReleased()) renderButton(i);
     }
 }
 
+int16_t rotary_steps = 0;
+
 void handleRotary() {
-    int rotary_pos_new = rotary.read();
-    if (rotary_pos_new != rotary_pos && rotary_pos_new % 4 == 0) {
+    int16_t steps = rotary.take();
+    if (steps != 0) {
 #ifdef DEBUG_LOG
-        Debug.print("rotary "); Debug.print(rotary_pos_new);
-        if (rotary_pos_new > rotary_pos) Debug.println(" >>");
-        else Debug.println(" <<");
+        Debug.print("rotary "); Debug.print(steps);
+        Debug.print(" v "); Debug.print(rotary.velocity());
+        Debug.print(" lost "); Debug.print(rotary.lost);
+        Debug.print(" coalesced "); Debug.println(rotary.coalesced);
 #endif
-        if (rotary_pos_new > rotary_pos) {
-            Keyboard.sendKeyStroke(rotary_key_cw);
+        rotary_steps += steps;
+    }
+
+    // steps that don't fit into the keyboard queue are kept for the next pass
+    while (rotary_steps != 0 && Keyboard.queueFree() >= 2) {
+        if (rotary_steps > 0) {
+            Keyboard.sendKeyStroke(CHORD_KEY(rotary_key_cw), CHORD_MODS(rotary_key_cw));
+            rotary_steps--;
         } else {
-            Keyboard.sendKeyStroke(rotary_key_ccw);
+            Keyboard.sendKeyStroke(CHORD_KEY(rotary_key_ccw), CHORD_MODS(rotary_key_ccw));
+            rotary_steps++;
         }
-
-        rotary_pos = rotary_pos_new;
     }
 }
 
 
-RingBuff_t Serial_Buffer;
-uint8_t serial_data[7] = { 0 };
-uint8_t serial_buffer_bytes = 0;
-
 bool onOffToggle(uint8_t data, bool current) {
     if (data == 0) {
         return false;
@@ -434,55 +711,131 @@ bool onOffToggle(uint8_t data, bool current) {
     return current;
 }
 
-int getIndex(uint8_t data, uint8_t current, uint8_t count) {
+uint8_t getIndex(uint8_t data, uint8_t current, uint8_t count) {
     if (data > 0 && data <= count) {
         return data - 1;
     }
     return current;
 }
 
-void bufferSerial() {
-    if (!Serial.available())
-        return;
+bool isSerialOpcode(uint8_t opcode) {
+    return opcode == 0x00 || opcode == 0xB0 || opcode == 0xBF || opcode == 0xF0
+        || opcode == 0xDD || opcode == 0x99 || opcode == 0xC0 || opcode == 0xA0 || opcode == 0xA1
+        || opcode == 0x4D || opcode == 0x4B || opcode == 0xB1;
+}
 
-    if (serial_buffer_bytes > 0 ) {
-        while (Serial.available() && serial_buffer_bytes > 0) {
-            serial_buffer_bytes--;
-            RingBuffer_Insert(&Serial_Buffer, Serial.read());
-        }
+/*
+ * RGB per button in button order, black turns the highlight off.
+ * All buttons change in the same refresh since the frame is pushed as a whole.
+ */
+void setRgbFrame(const uint8_t *rgb) {
+    for (uint8_t i = 0; i < BUTTON_COUNT; i++, rgb += 3) {
+        button_rgb[i] = pixels.Color(rgb[0], rgb[1], rgb[2]);
+        buttons_lit[i] = button_rgb[i] != 0;
+        button_colors[i] = buttons_lit[i] ? COLOR_RGB : 0;
+        renderButton(i);
     }
-    else if (Serial.read() == 0xCC) {
-        serial_buffer_bytes = 7;
+}
+
+uint8_t serial_seq = 0; // seq of the v2 frame being handled
+
+// the 16U2 firmware in fw/ would type anything we send, see USBKeyboard.h
+void sendReport(const uint8_t *report, uint8_t length) {
+    if (!Keyboard.hasFastLink()) return;
+    SerialParser::send(serial_seq, SERIAL_FLAG_REPORT, report, length);
+}
+
+void stopStream() {
+    stream_active = false;
+    renderButtons();
+}
+
+void receiveStreamFrame(uint8_t number, const uint8_t *rgb) {
+    if (stream_back_ready) stream_dropped++; // previous frame was never shown
+    if (stream_presented > 0 || stream_back_ready) {
+        stream_dropped += (uint8_t)(number - stream_expected); // lost on the way
     }
+    stream_expected = number + 1;
+
+    memcpy(stream_buffers[stream_front ^ 1], rgb, BUTTON_COUNT * 3);
+    stream_back_ready = true;
+    stream_last_frame = millis();
 }
 
-void handleSerial() {
-    if (RingBuffer_GetCount(&Serial_Buffer) < 7)
+/*
+ * frame tick of the stream, shows the newest complete frame
+ */
+void presentStream() {
+    if (!stream_active) return;
+
+    if (millis() - stream_last_frame > STREAM_TIMEOUT) {
+        stopStream();
         return;
+    }
 
-    for (uint8_t i=0; i<7; i++) {
-        serial_data[i] = RingBuffer_Remove(&Serial_Buffer);
+    if (!stream_back_ready) {
+        if (stream_presented > 0) stream_late++;
+        return;
     }
 
-    if (serial_data[0] == 0xB0) {
-        backlight = onOffToggle(serial_data[1], backlight);
-        backlight_color = getIndex(serial_data[2], backlight_color, colors_count);
+    stream_front ^= 1;
+    stream_back_ready = false;
+    stream_presented++;
+
+    renderButtons();
+    compositor.compose();
+    frame.show();
+}
+
+void startStream(uint8_t fps) {
+    if (fps < 16 || fps > 100) fps = STREAM_FPS;
+    scheduler.setPeriod(presentStream, 1000000UL / fps);
+    stopEffect();
+
+    memset(stream_buffers, 0, sizeof(stream_buffers));
+    stream_back_ready = false;
+    stream_last_frame = millis();
+    stream_presented = 0;
+    stream_dropped = 0;
+    stream_late = 0;
+    stream_active = true;
+}
+
+/*
+ * opcode + params, missing params read as 0
+ * 0x00 is a no-op used for throughput tests
+ */
+uint8_t handleCommand(uint8_t opcode, const uint8_t *params, uint8_t count) {
+    uint8_t padded[6] = { 0 };
+    if (count < 6) {
+        memcpy(padded, params, count);
+        params = padded;
+    }
+
+    if (opcode == 0xB0) {
+        backlight = onOffToggle(params[0], backlight);
+        backlight_color = getIndex(params[1], backlight_color, colors_count);
+    }
+
+    else if (opcode == 0xB1) {
+        if (count < 1) return SERIAL_STATUS_MALFORMED;
+        setBrightness(params[0]);
     }
 
-    else if (serial_data[0] == 0xBF && serial_data[1] > 0 && serial_data[1] <= BUTTON_COUNT) {
-        int8_t index = serial_data[1] - 1;
+    else if (opcode == 0xBF) {
+        int8_t index = params[0] - 1;
         if (index >= 0 && index < BUTTON_COUNT) {
-            buttons_lit[index] = onOffToggle(serial_data[2], buttons_lit[index]);
-            button_colors[index] = getIndex(serial_data[3], button_colors[index], colors_count);
+            buttons_lit[index] = onOffToggle(params[1], buttons_lit[index]);
+            button_colors[index] = getIndex(params[2], button_colors[index], colors_count);
         }
     }
 
-    else if (serial_data[0] == 0xF0) {
-        bool target = onOffToggle(serial_data[1], effect_active);
-        setEffect(getIndex(serial_data[2], effect_index, effects_count));
-        setEffectColor(getIndex(serial_data[3], effect_color, colors_count));
-        if (serial_data[4] > 0) {
-            setEffectSpeed(serial_data[4]*1000);
+    else if (opcode == 0xF0) {
+        bool target = onOffToggle(params[0], effect_active);
+        setEffect(getIndex(params[1], effect_index, effects_count));
+        setEffectColor(getIndex(params[2], effect_color, colors_count));
+        if (params[3] > 0) {
+            setEffectSpeed(params[3]*1000);
         }
 
         if (target && !effect_active) {
@@ -492,58 +845,241 @@ void handleSerial() {
         }
     }
 
-    else if (serial_data[0] == 0xDD) {
-        handleLedStatus(serial_data[1]);
+    else if (opcode == 0xDD) {
+        handleLedStatus(params[0]);
+    }
+
+    else if (opcode == 0xC0) {
+        if (count != BUTTON_COUNT * 3) return SERIAL_STATUS_MALFORMED;
+        setRgbFrame(params);
+    }
+
+    else if (opcode == 0xA0) {
+        if (params[0]) startStream(params[1]);
+        else if (stream_active) stopStream();
+    }
+
+    else if (opcode == 0xA1) {
+        if (count != 1 + BUTTON_COUNT * 3) return SERIAL_STATUS_MALFORMED;
+        if (stream_active) receiveStreamFrame(params[0], params + 1);
+    }
+
+    else if (opcode == 0x4D) {
+        if (count < 2) return SERIAL_STATUS_MALFORMED;
+        macros.write(params[0], params[1], params + 2, count - 2);
+    }
+
+    else if (opcode == 0x4B) {
+        if (keymapEntry(params[0]) == NULL) return SERIAL_STATUS_MALFORMED;
+        setKey(params[0], params[1], params[2], params[3]);
+    }
+
+    else if (opcode == 0x4C) {
+        uint8_t report[2 + (BUTTON_COUNT * 2 + 2) * 2] = { 0x4C };
+        KeymapState keymap;
+        snapshotKeymap(keymap);
+        report[1] = keymap.buttons_hold;
+        for (uint8_t i = 0; i < BUTTON_COUNT * 2 + 2; i++) {
+            uint16_t entry = *keymapEntry(i + 1);
+            report[2 + i * 2] = CHORD_MODS(entry);
+            report[3 + i * 2] = CHORD_KEY(entry);
+        }
+        sendReport(report, sizeof(report));
+    }
+
+    else if (opcode == 0xA2) {
+        uint8_t report[7] = { 0xA2,
+            (uint8_t)stream_presented, (uint8_t)(stream_presented >> 8),
+            (uint8_t)stream_dropped, (uint8_t)(stream_dropped >> 8),
+            (uint8_t)stream_late, (uint8_t)(stream_late >> 8) };
+        sendReport(report, sizeof(report));
     }
 
-    else if (serial_data[0] == 0x99) {
+    else if (opcode == 0x51) {
+        // indexes 1-based as the commands take them, button color 0 is RGB
+        uint8_t report[8 + BUTTON_COUNT * 4] = { 0x51,
+            (uint8_t)(backlight | effect_active << 1 | stream_active << 2), 0,
+            (uint8_t)(backlight_color + 1), (uint8_t)(effect_index + 1), (uint8_t)(effect_color + 1),
+            (uint8_t)(effect_speed / 1000), output.getBrightness() };
+        for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
+            if (buttons_lit[i]) report[2] |= 1 << i;
+            report[8 + i] = button_colors[i] + 1;
+            report[8 + BUTTON_COUNT + i * 3] = button_rgb[i] >> 16;
+            report[9 + BUTTON_COUNT + i * 3] = button_rgb[i] >> 8;
+            report[10 + BUTTON_COUNT + i * 3] = button_rgb[i];
+        }
+        sendReport(report, sizeof(report));
+    }
+
+    else if (opcode == 0x99) {
         reset();
     }
+
+    else if (opcode != 0x00) {
+        return SERIAL_STATUS_UNKNOWN;
+    }
+
+    return SERIAL_STATUS_OK;
+}
+
+/*
+ * v1 frames have room for 6 params, longer commands come split:
+ * 0xC0 index | R | G | B, the last button completes the frame
+ * 0xA1 number | index | R | G | B, the last button completes the frame
+ * 0x4D slot | offset | count | data[count], up to 3 bytes per frame
+ */
+void handleSerial(const uint8_t *frame) {
+    const uint8_t *params = frame + 1;
+    if (frame[0] == 0xC0) {
+        uint8_t index = getIndex(params[0], BUTTON_COUNT, BUTTON_COUNT);
+        if (index < BUTTON_COUNT) memcpy(rgb_partial + index * 3, params + 1, 3);
+        if (index == BUTTON_COUNT - 1) setRgbFrame(rgb_partial);
+    } else if (frame[0] == 0xA1) {
+        uint8_t index = getIndex(params[1], BUTTON_COUNT, BUTTON_COUNT);
+        if (index < BUTTON_COUNT) memcpy(stream_partial + index * 3, params + 2, 3);
+        if (index == BUTTON_COUNT - 1 && stream_active) receiveStreamFrame(params[0], stream_partial);
+    } else if (frame[0] == 0x4D) {
+        if (params[2] <= 3) macros.write(params[0], params[1], params + 3, params[2]);
+    } else {
+        handleCommand(frame[0], params, SERIAL_FRAME_SIZE - 1);
+    }
+    renderButtons();
+}
+
+/*
+ * v2 payload: opcode | count | params[count] ...
+ * reply payload: status | index of the first failed sub-command
+ * report payload: opcode | data, sent by commands that return data
+ */
+void handlePacket(uint8_t seq, uint8_t flags, const uint8_t *payload, uint8_t length, uint8_t status) {
+    uint8_t reply[2] = { status, 0 };
+    serial_seq = seq;
+
+    uint8_t index = 0;
+    for (uint8_t i = 0; status == SERIAL_STATUS_OK && i < length; index++) {
+        if (i + 2 > length || i + 2 + payload[i + 1] > length) {
+            status = SERIAL_STATUS_MALFORMED;
+        } else {
+            status = handleCommand(payload[i], payload + i + 2, payload[i + 1]);
+            i += 2 + payload[i + 1];
+        }
+
+        if (status != SERIAL_STATUS_OK) {
+            reply[0] = status;
+            reply[1] = index;
+        }
+        // unknown commands are reported, the rest of the frame still applies
+        if (status == SERIAL_STATUS_UNKNOWN) status = SERIAL_STATUS_OK;
+    }
+    renderButtons();
+
+    if ((flags & SERIAL_FLAG_ACK) && Keyboard.hasFastLink()) {
+        SerialParser::send(seq, 0, reply, sizeof(reply));
+    }
+}
+
+SerialParser serial_parser(handleSerial, isSerialOpcode, handlePacket);
+
+void serviceSerial() {
+    serial_parser.poll();
+}
+
+void serviceKeyboard() {
+    Keyboard.service();
+}
+
+void serviceMacros() {
+    macros.service();
+}
+
+void serviceState() {
+    KeymapState keymap;
+    snapshotKeymap(keymap);
+    keymap_store.update(&keymap);
+    keymap_store.service();
+
+    if (boot_anim > 0) return; // the boot animation isn't part of the state
+
+    DeviceState state;
+    snapshotState(state);
+    state_store.update(&state);
+    state_store.service();
+}
+
+void refreshLeds() {
+    if (effect_active) fx.service();
+    renderNotifications();
+    compositor.compose();
+    frame.show();
+
+    if (boot_anim > 0 && millis() >= boot_anim) {
+        stopEffect();
+        boot_anim = 0;
+    }
 }
 
 void setup() {
 #ifdef DEBUG_LOG
     Debug.begin(9600);
 #endif
-    for (int i = 0; i < BUTTON_COUNT; i++) {
-        pinMode(button_pins[i], INPUT_PULLUP);
-        buttons[i].begin();
+    defaultKeymap();
+    restoreKeymap();
+    ButtonInput.begin(buttonPins(), buttons, BUTTON_COUNT);
+    rotary.begin(PIN_ROTARY_DT, PIN_ROTARY_CLK);
+
+    pixels.begin();
+    pixels.clear();
+    applyEffect();
+    output.setLayerBrightness(LAYER_BACKLIGHT, BRIGHTNESS_BACKLIGHT);
+    output.setLayerBrightness(LAYER_EFFECT, BRIGHTNESS_EFFECT);
+    output.setLayerBrightness(LAYER_HIGHLIGHT, BRIGHTNESS_BUTTON);
+    output.setLayerBrightness(LAYER_PRESS, BRIGHTNESS_BUTTON);
+    output.setLayerBrightness(LAYER_NOTIFY, BRIGHTNESS_BUTTON);
+    frame.setMaxFps(LED_MAX_FPS);
+#if defined(DEBUG_LOG) && defined(EFFECT_BENCHMARK)
+    fx.benchmark(Debug);
+    compositor.clearLayer(LAYER_EFFECT);
+#endif
+
+    // show the saved state right away, the boot animation is for fresh devices
+    if (restoreState()) {
+        boot_anim = 0;
+    } else {
+        startEffect();
     }
+    renderButtons();
+    refreshLeds();
 
 #if !defined(DEBUG_LOG) || defined(DEBUG_SERIAL)
     Keyboard.init();
 #endif
-    pixels.begin();
-    pixels.clear();
-    setupEffects();
-    pixels.setBrightness(10);
-    startEffect();
-    delay(500);
+    if (boot_anim > 0) delay(500);
     if (!Keyboard.isConnected()) {
-        pixels_effect.setColor(RED);
+        fx.setColor(RED);
+        if (!effect_active) {
+            startEffect();
+            boot_anim = millis() + 7700;
+        }
     }
 
-	RingBuffer_InitBuffer(&Serial_Buffer);
+    // a task that doesn't fit would silently never run
+    bool scheduled = scheduler.addTask(handleRotary, PERIOD_ROTARY)
+        && scheduler.addTask(handleButtons, PERIOD_BUTTONS)
+        && scheduler.addTask(refreshLeds, PERIOD_LEDS)
+        && scheduler.addTask(serviceSerial, 0)
+        && scheduler.addTask(serviceKeyboard, 0)
+        && scheduler.addTask(serviceMacros, 0)
+        && scheduler.addTask(presentStream, 1000000UL / STREAM_FPS)
+        && scheduler.addTask(serviceState, PERIOD_STATE);
+    if (!scheduled) {
+#ifdef DEBUG_LOG
+        Debug.println("scheduler full, raise SCHEDULER_MAX_TASKS");
+#endif
+        fx.setColor(RED);
+        startEffect();
+    }
 }
 
 void loop() {
-    // handleLedStatus();
-    handleRotary();
-    handleButtons();
-
-    if (effect_active) pixels_effect.service();
-    else pixels.show();
-
-    if (effect_active && boot_anim == 5) {
-        stopEffect();
-    }
-    if (boot_anim > 0) {
-        boot_anim -= 5;
-    }
-
-    bufferSerial();
-    handleSerial();
-
-    delay(5);
+    scheduler.run();
 }
-